@@ -1,14 +1,22 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,6 +24,7 @@
 #include <unistd.h>
 
 #include "libhttp.h"
+#include "utlist.h"
 #include "wq.h"
 
 
@@ -25,196 +34,383 @@ int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+int event_loop;
+int keep_alive_timeout;
+int max_requests;
 
 #define MAX_SIZE 8192
+#define DEFAULT_KEEP_ALIVE_TIMEOUT 5
+#define DEFAULT_MAX_REQUESTS 100
+
+
+/* Ends the headers of a response with a body of length bytes, telling the
+ * client whether the connection stays open for another request */
+void end_response_headers(struct http_buffer *buffer, size_t length, int keep_alive) {
+    char content_length[32];
+    snprintf(content_length, sizeof(content_length), "%zu", length);
+    http_buffer_add_header(buffer, "Content-Length", content_length);
+    http_buffer_add_header(buffer, "Connection", keep_alive ? "keep-alive" : "close");
+    http_buffer_end_headers(buffer);
+}
 
 
-void prepare_http_response(int fd, char *path, struct stat *st);
+off_t build_file_response(struct http_buffer *buffer, char *path, int file, struct stat *st, int keep_alive);
 
-void send_file_content(int fd, char *path);
+void build_file_headers(struct http_buffer *buffer, char *path, struct stat *st, int keep_alive);
 
-void handle_file_open_error();
+int add_file_content(struct http_buffer *buffer, int file, size_t size);
 
-void handle_memory_allocation_error(int file);
+int send_file_content(int fd, int file, off_t size);
 
-void serve_file(int fd, char *path, struct stat *st) {
-    prepare_http_response(fd, path, st);
-    send_file_content(fd, path);
-}
+void send_http_error_response(int fd, int status_code, int keep_alive);
 
-void prepare_http_response(int fd, char *path, struct stat *st) {
-    long size = st->st_size;
-    char *content_size = malloc(MAX_SIZE * sizeof(char));
-    if (content_size == NULL) {
-        handle_memory_allocation_error(-1); // Passing -1 as no file is open yet
-        return;
-    }
-    sprintf(content_size, "%ld", size);
+void build_error_response(struct http_buffer *buffer, int status_code, int keep_alive);
 
-    http_start_response(fd, 200);
-    http_send_header(fd, "Content-Type", http_get_mime_type(path));
-    http_send_header(fd, "Content-Length", content_size);
-    http_end_headers(fd);
+/* Files up to this size go out in the same write as their headers, copied
+ * through user space; anything bigger is left to sendfile, which moves it
+ * from the page cache to the socket without a copy but costs a syscall of
+ * its own */
+#define SMALL_FILE_SIZE 16384
 
-    free(content_size);
-}
-
-void send_file_content(int fd, char *path) {
-    int file = open(path, O_RDONLY);
-    if (file == -1) {
-        handle_file_open_error();
-        return;
+/* Builds the response for the open file, with the file itself in it if it
+ * is small. Returns how much of the file is left to send after it. */
+off_t build_file_response(struct http_buffer *buffer, char *path, int file, struct stat *st, int keep_alive) {
+    build_file_headers(buffer, path, st, keep_alive);
+    if (st->st_size > SMALL_FILE_SIZE) {
+        return st->st_size;
     }
-
-    void *buffer = malloc(MAX_SIZE);
-    if (buffer == NULL) {
-        handle_memory_allocation_error(file);
-        return;
-    }
-
-    size_t read_size;
-    while ((read_size = read(file, buffer, MAX_SIZE)) > 0) {
-        http_send_data(fd, buffer, read_size);
+    if (add_file_content(buffer, file, st->st_size) == -1) {
+        buffer->size = 0;
+        build_error_response(buffer, 500, keep_alive);
     }
-
-    close(file);
-    free(buffer);
+    return 0;
 }
 
-void handle_file_open_error() {
-    // Implement error handling for file open failure
+void build_file_headers(struct http_buffer *buffer, char *path, struct stat *st, int keep_alive) {
+    http_buffer_start_response(buffer, 200);
+    http_buffer_add_header(buffer, "Content-Type", http_get_mime_type(path));
+    end_response_headers(buffer, st->st_size, keep_alive);
 }
 
-void handle_memory_allocation_error(int file) {
-    if (file != -1) {
-        close(file);
+/* Appends all size bytes of the file. Returns -1 if it cannot be read or
+ * has shrunk since its size was taken. */
+int add_file_content(struct http_buffer *buffer, int file, size_t size) {
+    http_buffer_reserve(buffer, size);
+    while (size > 0) {
+        ssize_t read_size = read(file, buffer->data + buffer->size, size);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            return -1;
+        }
+        buffer->size += read_size;
+        size -= read_size;
     }
-    // Implement error handling for memory allocation failure
+    return 0;
 }
 
+/* Sends size bytes of the file from where it is at. Returns -1 if they
+ * could not all be sent, the file having shrunk or the socket failed, which
+ * leaves the response cut short and the connection unusable. */
+int send_file_content(int fd, int file, off_t size) {
+    while (size > 0) {
+        ssize_t sent = sendfile(fd, file, NULL, size);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        size -= sent;
+    }
+    return 0;
+}
 
-void send_http_response_headers(int fd);
 
-void list_directory_contents(int fd, char *path);
+void build_directory_response(struct http_buffer *buffer, char *path, int keep_alive);
 
-void handle_directory_error(int fd);
+void build_directory_listing(struct http_buffer *buffer, char *path);
 
-void serve_directory(int fd, char *path) {
-    send_http_response_headers(fd);
-    list_directory_contents(fd, path);
-}
+void build_directory_response(struct http_buffer *buffer, char *path, int keep_alive) {
+    struct http_buffer listing = {0};
+    build_directory_listing(&listing, path);
 
-void send_http_response_headers(int fd) {
-    http_start_response(fd, 200);
-    http_send_header(fd, "Content-Type", http_get_mime_type(".html"));
-    http_end_headers(fd);
+    http_buffer_start_response(buffer, 200);
+    http_buffer_add_header(buffer, "Content-Type", http_get_mime_type(".html"));
+    end_response_headers(buffer, listing.size, keep_alive);
+    http_buffer_add_data(buffer, listing.data, listing.size);
+    http_buffer_free(&listing);
 }
 
-void list_directory_contents(int fd, char *path) {
+/* Appends a link per entry of the directory; nothing if it cannot be read */
+void build_directory_listing(struct http_buffer *buffer, char *path) {
     DIR *dir = opendir(path);
     if (!dir) {
-        handle_directory_error(fd);
-        return;
-    }
-
-    char *string = malloc(MAX_SIZE);
-    if (string == NULL) {
-        closedir(dir);
-        // You can also add error handling for memory allocation failure if needed
         return;
     }
 
     struct dirent *dirent;
     while ((dirent = readdir(dir)) != NULL) {
-        snprintf(string, MAX_SIZE, "<a href='./%s'>%s</a><br>\n", dirent->d_name, dirent->d_name);
-        http_send_string(fd, string);
+        http_buffer_printf(buffer, "<a href='./%s'>%s</a><br>\n", dirent->d_name, dirent->d_name);
     }
 
-    free(string);
     closedir(dir);
 }
 
-void handle_directory_error(int fd) {
-    // Implement error handling for directory open failure
-    // For example, send a 404 or 500 HTTP response
-}
 
+int validate_request(struct http_slice *path);
+
+char *construct_full_path(struct http_slice *path);
+
+char *find_directory_index(char *path, struct stat *st);
+
+void send_http_error_response(int fd, int status_code, int keep_alive);
+
+void build_error_response(struct http_buffer *buffer, int status_code, int keep_alive);
+
+int resolve_files_request(struct http_slice *request_path, char **path, struct stat *st);
 
-int validate_request(struct http_request *request, int fd);
+int read_request(int fd, struct http_parser *parser);
 
-char *construct_full_path(struct http_request *request);
+/* The methods the files handler answers; anything else gets a 501 */
+enum files_method { FILES_GET, FILES_HEAD, FILES_UNSUPPORTED };
 
-void handle_regular_file(int fd, char *path);
+enum files_method get_files_method(struct http_parser *parser, int parsed);
 
-void handle_directory_request(int fd, char *path);
+int slice_is(struct http_slice *slice, char *text);
 
-void send_http_error_response(int fd, int status_code);
+int serve_files_request(int fd, struct http_slice *request_path, enum files_method method, int keep_alive);
 
+off_t build_files_response(struct http_buffer *buffer, struct http_slice *request_path, enum files_method method,
+                           int keep_alive, int *file);
+
+void drop_response_body(struct http_buffer *buffer);
+
+extern int parked_epoll_fd;
+extern int *connection_requests;
+
+void park_connection(int fd, int requests);
+
+int request_waiting(int fd);
+
+/*
+ * Serves requests on fd until the client is done with the connection or has
+ * sent max_requests of them, then closes it. Bytes read past the end of a
+ * request are kept for the next one. Whenever there are none and the
+ * client has sent nothing more, the connection is parked (see
+ * park_connection) rather than left holding the thread.
+ */
 void handle_files_request(int fd) {
-    struct http_request *request = http_request_parse(fd);
-    if (!validate_request(request, fd)) return;
+    int served = connection_requests != NULL ? connection_requests[fd] : 0;
+    if (served == 0) {
+        /* Bounds the wait for the rest of a request once it has started to
+         * arrive, and for the first one when nothing is parked */
+        struct timeval timeout = {keep_alive_timeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    char buffer[MAX_SIZE];
+    struct http_parser parser;
+    http_parser_init(&parser, buffer, sizeof(buffer));
+    while (served < max_requests) {
+        if (parser.size == 0 && parked_epoll_fd != -1 && !request_waiting(fd)) {
+            park_connection(fd, served);
+            return;
+        }
+        int result = read_request(fd, &parser);
+        if (result == HTTP_PARSE_INCOMPLETE) {
+            break;
+        }
+
+        served++;
+        enum files_method method = get_files_method(&parser, result);
+        int keep_alive = result == HTTP_PARSE_DONE && parser.keep_alive && served < max_requests &&
+                         method != FILES_UNSUPPORTED && parked_epoll_fd != -1;
+        if (serve_files_request(fd, result == HTTP_PARSE_DONE ? &parser.path : NULL, method, keep_alive) == -1 ||
+            !keep_alive) {
+            break;
+        }
+        http_parser_next(&parser);
+    }
+    close(fd);
+}
+
+/* Whether the client has sent something, or closed, without waiting */
+int request_waiting(int fd) {
+    struct pollfd ready = {.fd = fd, .events = POLLIN};
+    return poll(&ready, 1, 0) != 0;
+}
+
+/* Reads until the parser has the whole request or has given up on it.
+ * Returns HTTP_PARSE_INCOMPLETE if the connection fails, times out or is
+ * closed between requests. */
+int read_request(int fd, struct http_parser *parser) {
+    int result;
+    while ((result = http_parser_parse(parser)) == HTTP_PARSE_INCOMPLETE) {
+        ssize_t bytes_read = read(fd, parser->buffer + parser->size, parser->capacity - parser->size);
+        if (bytes_read < 0 || (bytes_read == 0 && parser->size == 0)) {
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        if (bytes_read == 0) {
+            return http_parser_finish(parser);
+        }
+        parser->size += bytes_read;
+    }
+    return result;
+}
+
+/* GET for a request that could not be parsed, which is answered with a 400
+ * whatever its method */
+enum files_method get_files_method(struct http_parser *parser, int parsed) {
+    if (parsed != HTTP_PARSE_DONE || slice_is(&parser->method, "GET")) {
+        return FILES_GET;
+    }
+    return slice_is(&parser->method, "HEAD") ? FILES_HEAD : FILES_UNSUPPORTED;
+}
+
+int slice_is(struct http_slice *slice, char *text) {
+    size_t length = strlen(text);
+    return slice->length == length && memcmp(slice->data, text, length) == 0;
+}
+
+/* Returns -1 if the response could not all be sent */
+int serve_files_request(int fd, struct http_slice *request_path, enum files_method method, int keep_alive) {
+    struct http_buffer response = {0};
+    int file = -1;
+    off_t file_left = build_files_response(&response, request_path, method, keep_alive, &file);
+    int result = http_send_data(fd, response.data, response.size);
+    if (result == 0) {
+        result = send_file_content(fd, file, file_left);
+    }
+
+    http_buffer_free(&response);
+    if (file != -1) {
+        close(file);
+    }
+    return result;
+}
 
-    char *path = construct_full_path(request);
+/*
+ * Builds the whole answer to a request for request_path, as for
+ * resolve_files_request, except for the rest of a large file, which is left
+ * in *file for the caller to send and close. Returns how much of it there
+ * is. HEAD gets the same headers GET would, without the body.
+ */
+off_t build_files_response(struct http_buffer *buffer, struct http_slice *request_path, enum files_method method,
+                           int keep_alive, int *file) {
+    char *path = NULL;
     struct stat file_stat;
-    if (stat(path, &file_stat) == -1) {
-        send_http_error_response(fd, 404);
-        free(path);
-        return;
+    int status = method == FILES_UNSUPPORTED ? 501 : resolve_files_request(request_path, &path, &file_stat);
+    off_t file_left = 0;
+
+    if (status == 200 && S_ISREG(file_stat.st_mode)) {
+        *file = open(path, O_RDONLY | O_CLOEXEC);
+        status = *file == -1 ? 404 : 200;
     }
 
-    if (S_ISREG(file_stat.st_mode)) {
-        handle_regular_file(fd, path);
+    if (status != 200) {
+        build_error_response(buffer, status, keep_alive);
     } else if (S_ISDIR(file_stat.st_mode)) {
-        handle_directory_request(fd, path);
+        build_directory_response(buffer, path, keep_alive);
+    } else if (method == FILES_HEAD) {
+        build_file_headers(buffer, path, &file_stat, keep_alive);
     } else {
-        send_http_error_response(fd, 404);
+        file_left = build_file_response(buffer, path, *file, &file_stat, keep_alive);
     }
-
     free(path);
-    close(fd);
+
+    if (method == FILES_HEAD) {
+        drop_response_body(buffer);
+    }
+    return file_left;
 }
 
-int validate_request(struct http_request *request, int fd) {
-    if (request == NULL || request->path[0] != '/' || strstr(request->path, "..") != NULL) {
-        send_http_error_response(fd, request == NULL || request->path[0] != '/' ? 400 : 403);
-        return 0;
+/* Cuts the buffer off after the blank line that ends the headers */
+void drop_response_body(struct http_buffer *buffer) {
+    char *end = memmem(buffer->data, buffer->size, "\r\n\r\n", 4);
+    if (end != NULL) {
+        buffer->size = end + 4 - buffer->data;
     }
-    return 1;
 }
 
-char *construct_full_path(struct http_request *request) {
-    char *path = malloc(strlen(server_files_directory) + strlen(request->path) + 1); // +1 for null terminator
-    strcpy(path, server_files_directory);
-    strcat(path, request->path);
-    return path;
+/*
+ * Works out what a request for request_path gets, NULL being a request that
+ * could not be parsed: an error status, or 200 with *path set to the file
+ * to send or the directory to list, and *st saying which. Directories are
+ * served by their index.html if they have one. The caller frees *path.
+ */
+int resolve_files_request(struct http_slice *request_path, char **path, struct stat *st) {
+    int status = validate_request(request_path);
+    if (status != 200) {
+        return status;
+    }
+
+    *path = construct_full_path(request_path);
+    if (stat(*path, st) == -1 || !(S_ISREG(st->st_mode) || S_ISDIR(st->st_mode))) {
+        return 404;
+    }
+
+    if (S_ISDIR(st->st_mode)) {
+        char *index_path = find_directory_index(*path, st);
+        if (index_path != NULL) {
+            free(*path);
+            *path = index_path;
+        }
+    }
+    return 200;
 }
 
-void handle_regular_file(int fd, char *path) {
-    struct stat file_stat;
-    if (stat(path, &file_stat) == 0) {
-        serve_file(fd, path, &file_stat);
+int validate_request(struct http_slice *path) {
+    if (path == NULL || path->data[0] != '/') {
+        return 400;
+    }
+    if (memmem(path->data, path->length, "..", 2) != NULL || memchr(path->data, '\0', path->length) != NULL) {
+        return 403;
     }
+    return 200;
 }
 
-void handle_directory_request(int fd, char *path) {
-    struct stat file_stat;
+char *construct_full_path(struct http_slice *request_path) {
+    size_t directory_length = strlen(server_files_directory);
+    char *path = malloc(directory_length + request_path->length + 1); // +1 for null terminator
+    memcpy(path, server_files_directory, directory_length);
+    memcpy(path + directory_length, request_path->data, request_path->length);
+    path[directory_length + request_path->length] = '\0';
+    return path;
+}
+
+/* The directory's index.html, with *st filled in for it, or NULL */
+char *find_directory_index(char *path, struct stat *st) {
     char *index_path = malloc(strlen(path) + strlen("/index.html") + 1); // +1 for null terminator
     strcpy(index_path, path);
     strcat(index_path, "/index.html");
 
-    if (stat(index_path, &file_stat) == 0) {
-        serve_file(fd, index_path, &file_stat);
-    } else {
-        serve_directory(fd, path);
+    if (stat(index_path, st) == 0 && S_ISREG(st->st_mode)) {
+        return index_path;
     }
 
     free(index_path);
+    stat(path, st);
+    return NULL;
 }
 
-void send_http_error_response(int fd, int status_code) {
-    http_start_response(fd, status_code);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
+void send_http_error_response(int fd, int status_code, int keep_alive) {
+    struct http_buffer response = {0};
+    build_error_response(&response, status_code, keep_alive);
+    http_send_data(fd, response.data, response.size);
+    http_buffer_free(&response);
+}
+
+void build_error_response(struct http_buffer *buffer, int status_code, int keep_alive) {
+    char body[128];
+    int length = snprintf(body, sizeof(body), "<center><h1>%d %s</h1><hr></center>", status_code,
+                          http_get_response_message(status_code));
+
+    http_buffer_start_response(buffer, status_code);
+    http_buffer_add_header(buffer, "Content-Type", "text/html");
+    end_response_headers(buffer, length, keep_alive);
+    http_buffer_add_data(buffer, body, length);
 }
 
 
@@ -315,11 +511,8 @@ int setup_connection(struct sockaddr_in *target_address, int *target_fd) {
 }
 
 void handle_connection_error(int fd, int target_fd) {
-    http_request_parse(fd);
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    http_request_free(http_request_parse(fd));
+    send_http_error_response(fd, 502, 0);
     if (target_fd != -1) {
         close(target_fd);
     }
@@ -378,13 +571,636 @@ void setup_proxy_threads(int fd, int target_fd) {
 
 //KOOOOOOOOOOOOOSE
 
+/* Handlers close the connection themselves, or hand it on */
 void *th_handle(void *args) {
     void (*func)(int) = args;
     while (1) {
         int fd = wq_pop(&work_queue);
         func(fd);
+    }
+}
+
+
+/*
+ * Kept-alive connections between requests, in blocking mode with a thread
+ * pool. Waiting in read for a client's next request would hold a thread
+ * for up to keep_alive_timeout, and a few idle clients would hold them
+ * all. Instead the connection is parked here: one thread watches every
+ * parked socket with epoll, puts a connection back on the work queue once
+ * the client sends more or closes, and closes it once it has been idle
+ * for keep_alive_timeout. Without a thread pool there is no one to serve
+ * other clients meanwhile, so parked_epoll_fd stays -1 and keep-alive
+ * is off.
+ */
+struct parked_connection {
+    int fd;
+    long long deadline; /* In ms of CLOCK_MONOTONIC */
+    struct parked_connection *prev;
+    struct parked_connection *next;
+};
+
+int parked_epoll_fd = -1;
+/* Wakes the watcher when the first connection is parked, so it starts
+ * counting down to that connection's deadline */
+int parked_wakeup_fd = -1;
+pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Oldest first, so deadlines are in order */
+struct parked_connection *parked = NULL;
+/* Requests served so far on each connection, by fd */
+int *connection_requests = NULL;
+
+long long monotonic_ms();
+
+void *watch_parked_connections(void *args);
+
+void init_parked_connections() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return;
+    }
+    connection_requests = calloc(limit.rlim_cur, sizeof(int));
+    parked_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    parked_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    pthread_t thread;
+    if (connection_requests == NULL || parked_epoll_fd == -1 || parked_wakeup_fd == -1 ||
+        epoll_ctl(parked_epoll_fd, EPOLL_CTL_ADD, parked_wakeup_fd, &event) == -1 ||
+        pthread_create(&thread, NULL, watch_parked_connections, NULL) != 0) {
+        perror("Failed to set up keep-alive, continuing without it");
+        if (parked_epoll_fd != -1) {
+            close(parked_epoll_fd);
+        }
+        parked_epoll_fd = -1;
+    }
+}
+
+void park_connection(int fd, int requests) {
+    struct parked_connection *connection = malloc(sizeof(struct parked_connection));
+    if (connection == NULL) {
+        close(fd);
+        return;
+    }
+    connection->fd = fd;
+    connection->deadline = monotonic_ms() + keep_alive_timeout * 1000LL;
+    connection_requests[fd] = requests;
+
+    pthread_mutex_lock(&parked_lock);
+    int first = parked == NULL;
+    DL_APPEND(parked, connection);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+    if (epoll_ctl(parked_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        DL_DELETE(parked, connection);
         close(fd);
+        free(connection);
+    } else if (first) {
+        eventfd_write(parked_wakeup_fd, 1);
+    }
+    pthread_mutex_unlock(&parked_lock);
+}
+
+/* Takes the connection off the watch list; the caller closes or requeues it */
+void unpark_connection(struct parked_connection *connection) {
+    epoll_ctl(parked_epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    DL_DELETE(parked, connection);
+}
+
+void *watch_parked_connections(void *args) {
+    struct epoll_event events[64];
+    while (1) {
+        int timeout = -1;
+        pthread_mutex_lock(&parked_lock);
+        if (parked != NULL) {
+            long long wait = parked->deadline - monotonic_ms();
+            timeout = wait > 0 ? (int) wait : 0;
+        }
+        pthread_mutex_unlock(&parked_lock);
+
+        int count = epoll_wait(parked_epoll_fd, events, 64, timeout);
+
+        pthread_mutex_lock(&parked_lock);
+        for (int i = 0; i < count; i++) {
+            struct parked_connection *connection = events[i].data.ptr;
+            if (connection == NULL) {
+                eventfd_t value;
+                eventfd_read(parked_wakeup_fd, &value);
+                continue;
+            }
+            unpark_connection(connection);
+            wq_push(&work_queue, connection->fd);
+            free(connection);
+        }
+        long long now = monotonic_ms();
+        while (parked != NULL && parked->deadline <= now) {
+            struct parked_connection *connection = parked;
+            unpark_connection(connection);
+            close(connection->fd);
+            free(connection);
+        }
+        pthread_mutex_unlock(&parked_lock);
     }
+    return NULL;
+}
+
+
+/*
+ * Event loop mode (--event-loop). The listening socket and every accepted
+ * connection are non-blocking, and each of --num-threads loop threads (one
+ * by default) waits on its own epoll set, so a thread can hold thousands
+ * of connections where a pool worker holds one. A thread keeps the
+ * connections it accepts and needs no locks. Connections go through the
+ * same steps as handle_files_request and handle_proxy_request, each one
+ * run as far as the socket lets it before going back to epoll_wait.
+ *
+ * Connections waiting for a request sit on the loop's idle list in the
+ * order they started waiting, which with one timeout for all of them is
+ * also the order they expire in; epoll_wait sleeps until the first one.
+ */
+
+#define LOOP_EVENTS 256
+
+enum connection_state {
+    READING_REQUEST,  /* Collecting the request head */
+    SENDING_RESPONSE, /* Writing out the response, then closing */
+    CONNECTING,       /* Proxy: waiting for the target to accept */
+    RELAYING,         /* Proxy: copying both ways until both sides are done */
+};
+
+struct connection;
+
+/* One socket of a connection; what each epoll event points at */
+struct endpoint {
+    int fd;
+    uint32_t events; /* As registered with epoll, 0 for not registered */
+    struct connection *connection;
+};
+
+struct connection {
+    enum connection_state state;
+    struct endpoint client;
+    struct endpoint target;
+    /* Requests, parsed in place, and when relaying, bytes on their way to
+     * the target, counted by in_size instead */
+    char in[MAX_SIZE];
+    struct http_parser parser;
+    size_t in_size;
+    size_t in_sent;
+    int requests;
+    int keep_alive;
+    /* The response, and when relaying, bytes on their way to the client */
+    struct http_buffer out;
+    size_t out_sent;
+    /* What is left of the file after out */
+    int file;
+    off_t file_left;
+    /* 1 once the side has closed, 2 once that is passed on to the other */
+    int client_eof;
+    int target_eof;
+    int bad_gateway;
+    int closed;
+    struct connection *next_closed;
+    /* Waiting for a request until deadline, in ms of CLOCK_MONOTONIC */
+    int idle;
+    long long deadline;
+    struct connection *idle_prev;
+    struct connection *idle_next;
+};
+
+struct event_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int server_socket;
+    int proxy;
+    /* Closed during the current batch of events, freed after it */
+    struct connection *closed;
+    struct connection *idle;
+};
+
+struct sockaddr_in proxy_address;
+int proxy_address_ready;
+
+void *run_event_loop(void *args);
+
+void accept_connections(struct event_loop *loop);
+
+void handle_event(struct event_loop *loop, struct endpoint *endpoint, uint32_t events);
+
+int handle_client(struct connection *connection, uint32_t events);
+
+int handle_target(struct connection *connection, uint32_t events);
+
+int parse_request(struct connection *connection);
+
+void start_response(struct connection *connection, int parsed);
+
+void next_request(struct connection *connection);
+
+void start_files_response(struct connection *connection, int parsed);
+
+int flush_to_client(struct connection *connection);
+
+void update_connection(struct event_loop *loop, struct connection *connection);
+
+void close_connection(struct event_loop *loop, struct connection *connection);
+
+void serve_event_loops(int server_socket, void (*request_handler)(int)) {
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+
+    /* Thousands of connections need as many descriptors as we may have */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int proxy = request_handler == handle_proxy_request;
+    if (proxy) {
+        /* Looked up once here rather than blocking a loop per connection;
+         * if it fails, every request gets the 502 handle_proxy_request sends */
+        struct sockaddr_in *target_address = &proxy_address;
+        struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+        if (target_dns_entry != NULL) {
+            target_address->sin_family = AF_INET;
+            target_address->sin_port = htons(server_proxy_port);
+            memcpy(&target_address->sin_addr, target_dns_entry->h_addr_list[0], sizeof(target_address->sin_addr));
+            proxy_address_ready = 1;
+        } else {
+            fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
+        }
+    }
+
+    int loops = num_threads > 0 ? num_threads : 1;
+    struct event_loop *event_loops = calloc(loops, sizeof(struct event_loop));
+    for (int i = 0; i < loops; i++) {
+        event_loops[i].server_socket = server_socket;
+        event_loops[i].proxy = proxy;
+        event_loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (event_loops[i].epoll_fd == -1) {
+            perror("Failed to create epoll instance");
+            exit(errno);
+        }
+        pthread_create(&event_loops[i].thread, NULL, run_event_loop, &event_loops[i]);
+    }
+    for (int i = 0; i < loops; i++) {
+        pthread_join(event_loops[i].thread, NULL);
+    }
+}
+
+long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+void *run_event_loop(void *args) {
+    struct event_loop *loop = args;
+
+    /* Every loop waits on the listening socket; EPOLLEXCLUSIVE wakes one
+     * of them per new connection rather than all of them */
+    struct endpoint listener = {loop->server_socket, EPOLLIN | EPOLLEXCLUSIVE, NULL};
+    struct epoll_event event = {.events = listener.events, .data.ptr = &listener};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_socket, &event) == -1) {
+        perror("Failed to watch the server socket");
+        return NULL;
+    }
+
+    struct epoll_event events[LOOP_EVENTS];
+    while (1) {
+        int timeout = -1;
+        if (loop->idle != NULL) {
+            long long wait = loop->idle->deadline - monotonic_ms();
+            timeout = wait > 0 ? wait : 0;
+        }
+        int count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            struct endpoint *endpoint = events[i].data.ptr;
+            if (endpoint == &listener) {
+                accept_connections(loop);
+            } else if (!endpoint->connection->closed) {
+                handle_event(loop, endpoint, events[i].events);
+            }
+        }
+
+        long long now = monotonic_ms();
+        while (loop->idle != NULL && loop->idle->deadline <= now) {
+            close_connection(loop, loop->idle);
+        }
+
+        /* Both sockets of a connection can be in one batch, so nothing is
+         * freed until the batch is done */
+        while (loop->closed != NULL) {
+            struct connection *connection = loop->closed;
+            loop->closed = connection->next_closed;
+            free(connection);
+        }
+    }
+}
+
+void accept_connections(struct event_loop *loop) {
+    while (1) {
+        struct sockaddr_in client_address;
+        socklen_t client_address_length = sizeof(client_address);
+        int client_socket = accept4(loop->server_socket, (struct sockaddr *) &client_address,
+                                    &client_address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("Error accepting socket");
+            }
+            return;
+        }
+
+        printf("Accepted connection from %s on port %d\n", inet_ntoa(client_address.sin_addr),
+               ntohs(client_address.sin_port));
+
+        int no_delay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        struct connection *connection = calloc(1, sizeof(struct connection));
+        if (connection == NULL) {
+            close(client_socket);
+            continue;
+        }
+        connection->client = (struct endpoint) {client_socket, 0, connection};
+        connection->target = (struct endpoint) {-1, 0, connection};
+        connection->file = -1;
+        connection->state = READING_REQUEST;
+        http_parser_init(&connection->parser, connection->in, sizeof(connection->in));
+
+        if (loop->proxy) {
+            int target_fd = proxy_address_ready ? socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) : -1;
+            if (target_fd != -1 && (connect(target_fd, (struct sockaddr *) &proxy_address, sizeof(proxy_address)) == 0 ||
+                                    errno == EINPROGRESS)) {
+                connection->target.fd = target_fd;
+                connection->state = CONNECTING;
+            } else {
+                if (target_fd != -1) {
+                    close(target_fd);
+                }
+                connection->bad_gateway = 1;
+            }
+        }
+        update_connection(loop, connection);
+    }
+}
+
+void handle_event(struct event_loop *loop, struct endpoint *endpoint, uint32_t events) {
+    struct connection *connection = endpoint->connection;
+    int result = endpoint == &connection->client ? handle_client(connection, events)
+                                                 : handle_target(connection, events);
+    if (result == -1) {
+        close_connection(loop, connection);
+        return;
+    }
+
+    /* Pass on each side's end of stream once its last bytes are through */
+    if (connection->state == RELAYING) {
+        if (connection->client_eof == 1 && connection->in_sent == connection->in_size) {
+            shutdown(connection->target.fd, SHUT_WR);
+            connection->client_eof = 2;
+        }
+        if (connection->target_eof == 1 && connection->out_sent == connection->out.size) {
+            shutdown(connection->client.fd, SHUT_WR);
+            connection->target_eof = 2;
+        }
+    }
+
+    int finished = connection->state == RELAYING ? connection->client_eof == 2 && connection->target_eof == 2
+                   : connection->state == SENDING_RESPONSE ? connection->out_sent == connection->out.size &&
+                                                             connection->file_left == 0
+                   : 0;
+    if (finished && connection->state == SENDING_RESPONSE && connection->keep_alive) {
+        next_request(connection);
+        finished = 0;
+    }
+    if (finished) {
+        close_connection(loop, connection);
+    } else {
+        update_connection(loop, connection);
+    }
+}
+
+/* Reads what is there into buffer. Returns -1 on an error, else 0 with *eof
+ * set if the other side has closed. */
+int read_available(int fd, char *buffer, size_t capacity, size_t *size, int *eof) {
+    ssize_t bytes_read = read(fd, buffer + *size, capacity - *size);
+    if (bytes_read > 0) {
+        *size += bytes_read;
+    } else if (bytes_read == 0) {
+        *eof = 1;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes what the socket takes. Returns -1 on an error. */
+int write_available(int fd, char *buffer, size_t size, size_t *sent) {
+    while (*sent < size) {
+        ssize_t bytes_sent = write(fd, buffer + *sent, size - *sent);
+        if (bytes_sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        *sent += bytes_sent;
+    }
+    return 0;
+}
+
+/* Parses what has come in of the next request, all of it if the client
+ * has stopped sending. HTTP_PARSE_INCOMPLETE means there is none yet. */
+int parse_request(struct connection *connection) {
+    int result = http_parser_parse(&connection->parser);
+    if (result == HTTP_PARSE_INCOMPLETE && connection->client_eof && connection->parser.size != 0) {
+        result = http_parser_finish(&connection->parser);
+    }
+    return result;
+}
+
+int handle_client(struct connection *connection, uint32_t events) {
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && connection->client.events & EPOLLIN) {
+        size_t *size = connection->state == READING_REQUEST ? &connection->parser.size : &connection->in_size;
+        if (read_available(connection->client.fd, connection->in, MAX_SIZE, size, &connection->client_eof) == -1) {
+            return -1;
+        }
+        if (connection->state == READING_REQUEST) {
+            int result = parse_request(connection);
+            if (result != HTTP_PARSE_INCOMPLETE) {
+                start_response(connection, result);
+            } else if (connection->client_eof) {
+                return -1;
+            }
+        }
+    }
+
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        return flush_to_client(connection);
+    }
+    return 0;
+}
+
+int handle_target(struct connection *connection, uint32_t events) {
+    if (connection->state == CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(connection->target.fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            /* Answer the request with a 502 as handle_proxy_request does */
+            close(connection->target.fd);
+            connection->target = (struct endpoint) {-1, 0, connection};
+            connection->bad_gateway = 1;
+            connection->state = READING_REQUEST;
+            connection->parser.size = connection->in_size;
+            connection->in_size = 0;
+            int result = parse_request(connection);
+            if (result != HTTP_PARSE_INCOMPLETE) {
+                start_response(connection, result);
+            }
+            return 0;
+        }
+        connection->state = RELAYING;
+    }
+
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && connection->target.events & EPOLLIN) {
+        http_buffer_reserve(&connection->out, MAX_SIZE);
+        if (read_available(connection->target.fd, connection->out.data, connection->out.capacity,
+                           &connection->out.size, &connection->target_eof) == -1) {
+            return -1;
+        }
+    }
+
+    if (write_available(connection->target.fd, connection->in, connection->in_size, &connection->in_sent) == -1) {
+        return -1;
+    }
+    if (connection->in_sent == connection->in_size) {
+        connection->in_size = connection->in_sent = 0;
+    }
+    return 0;
+}
+
+/* Sets up the answer to the request the parser has finished with */
+void start_response(struct connection *connection, int parsed) {
+    connection->requests++;
+    if (connection->bad_gateway) {
+        build_error_response(&connection->out, 502, 0);
+    } else {
+        start_files_response(connection, parsed);
+    }
+    connection->state = SENDING_RESPONSE;
+}
+
+/* Drops the request just answered and starts on the next one, which is
+ * already in the buffer if the client pipelines */
+void next_request(struct connection *connection) {
+    http_parser_next(&connection->parser);
+    connection->out.size = connection->out_sent = 0;
+    if (connection->file != -1) {
+        close(connection->file);
+        connection->file = -1;
+    }
+
+    connection->state = READING_REQUEST;
+    int result = parse_request(connection);
+    if (result != HTTP_PARSE_INCOMPLETE) {
+        start_response(connection, result);
+    }
+}
+
+void start_files_response(struct connection *connection, int parsed) {
+    struct http_parser *parser = &connection->parser;
+    enum files_method method = get_files_method(parser, parsed);
+    connection->keep_alive = parsed == HTTP_PARSE_DONE && parser->keep_alive && connection->requests < max_requests &&
+                             method != FILES_UNSUPPORTED;
+    connection->file_left = build_files_response(&connection->out, parsed == HTTP_PARSE_DONE ? &parser->path : NULL,
+                                                 method, connection->keep_alive, &connection->file);
+}
+
+/* Writes out, then sendfiles what is left of the file until the socket
+ * is full */
+int flush_to_client(struct connection *connection) {
+    if (write_available(connection->client.fd, connection->out.data, connection->out.size,
+                        &connection->out_sent) == -1) {
+        return -1;
+    }
+    if (connection->out_sent < connection->out.size) {
+        return 0;
+    }
+    connection->out.size = connection->out_sent = 0;
+
+    while (connection->file_left > 0) {
+        ssize_t sent = sendfile(connection->client.fd, connection->file, NULL, connection->file_left);
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        if (sent == 0) {
+            return -1;
+        }
+        connection->file_left -= sent;
+    }
+    return 0;
+}
+
+void update_endpoint(struct event_loop *loop, struct endpoint *endpoint, uint32_t events) {
+    if (endpoint->fd == -1 || endpoint->events == events) {
+        return;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = endpoint};
+    if (events == 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, endpoint->fd, NULL);
+    } else {
+        epoll_ctl(loop->epoll_fd, endpoint->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, endpoint->fd, &event);
+    }
+    endpoint->events = events;
+}
+
+/* Watches each socket for what the connection can do next. Neither side is
+ * read while the bytes it last sent are still waiting to go out. */
+void update_connection(struct event_loop *loop, struct connection *connection) {
+    uint32_t client = 0;
+    uint32_t target = 0;
+    switch (connection->state) {
+        case READING_REQUEST:
+            client = EPOLLIN;
+            break;
+        case SENDING_RESPONSE:
+            client = EPOLLOUT;
+            break;
+        case CONNECTING:
+            client = !connection->client_eof && connection->in_size < MAX_SIZE ? EPOLLIN : 0;
+            target = EPOLLOUT;
+            break;
+        case RELAYING:
+            client = (!connection->client_eof && connection->in_size == 0 ? EPOLLIN : 0) |
+                     (connection->out_sent < connection->out.size ? EPOLLOUT : 0);
+            target = (!connection->target_eof && connection->out.size == 0 ? EPOLLIN : 0) |
+                     (connection->in_sent < connection->in_size ? EPOLLOUT : 0);
+            break;
+    }
+    update_endpoint(loop, &connection->client, client);
+    update_endpoint(loop, &connection->target, target);
+
+    if (connection->state == READING_REQUEST && !connection->idle) {
+        connection->deadline = monotonic_ms() + keep_alive_timeout * 1000LL;
+        DL_APPEND2(loop->idle, connection, idle_prev, idle_next);
+        connection->idle = 1;
+    } else if (connection->state != READING_REQUEST && connection->idle) {
+        DL_DELETE2(loop->idle, connection, idle_prev, idle_next);
+        connection->idle = 0;
+    }
+}
+
+void close_connection(struct event_loop *loop, struct connection *connection) {
+    if (connection->idle) {
+        DL_DELETE2(loop->idle, connection, idle_prev, idle_next);
+        connection->idle = 0;
+    }
+    close(connection->client.fd);
+    if (connection->target.fd != -1) {
+        close(connection->target.fd);
+    }
+    if (connection->file != -1) {
+        close(connection->file);
+    }
+    http_buffer_free(&connection->out);
+    connection->closed = 1;
+    connection->next_closed = loop->closed;
+    loop->closed = connection;
 }
 
 
@@ -403,8 +1219,16 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
     *socket_number = setup_server_socket(socket_number);
     if (*socket_number == -1) return;
 
+    if (event_loop) {
+        serve_event_loops(*socket_number, request_handler);
+        return;
+    }
+
     wq_init(&work_queue);
     init_thread_pool(request_handler);
+    if (num_threads != 0 && request_handler == handle_files_request) {
+        init_parked_connections();
+    }
 
     while (1) {
         handle_new_connection(*socket_number, request_handler);
@@ -463,11 +1287,18 @@ void handle_new_connection(int server_socket, void (*request_handler)(int)) {
     printf("Accepted connection from %s on port %d\n", inet_ntoa(client_address.sin_addr),
            ntohs(client_address.sin_port));
 
+    /* Headers and body go out in separate writes; without this the body of
+     * a response on a kept-alive connection waits for a delayed ACK */
+    int no_delay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    if (connection_requests != NULL) {
+        connection_requests[client_socket] = 0;
+    }
     if (num_threads != 0) {
         wq_push(&work_queue, client_socket);
     } else {
         request_handler(client_socket);
-        close(client_socket);
     }
 }
 
@@ -488,8 +1319,13 @@ void signal_callback_handler(int signum) {
 }
 
 char *USAGE =
-        "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-        "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+        "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5] [--event-loop]\n"
+        "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5] [--event-loop]\n"
+        "\n"
+        "With --event-loop, --num-threads is the number of epoll loop threads.\n"
+        "Connections are kept open for --max-requests requests (100), or until idle\n"
+        "for --keep-alive-timeout seconds (5); --max-requests 1 turns keep-alive off.\n"
+        "Without --event-loop, keep-alive also needs --num-threads.\n";
 
 void exit_with_usage() {
     fprintf(stderr, "%s", USAGE);
@@ -502,6 +1338,8 @@ int main(int argc, char **argv) {
 
     /* Default settings */
     server_port = 8000;
+    keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
+    max_requests = DEFAULT_MAX_REQUESTS;
     void (*request_handler)(int) = NULL;
 
     int i;
@@ -545,6 +1383,20 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Expected positive integer after --num-threads\n");
                 exit_with_usage();
             }
+        } else if (strcmp("--keep-alive-timeout", argv[i]) == 0) {
+            char *timeout_str = argv[++i];
+            if (!timeout_str || (keep_alive_timeout = atoi(timeout_str)) < 1) {
+                fprintf(stderr, "Expected positive integer after --keep-alive-timeout\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--max-requests", argv[i]) == 0) {
+            char *max_requests_str = argv[++i];
+            if (!max_requests_str || (max_requests = atoi(max_requests_str)) < 1) {
+                fprintf(stderr, "Expected positive integer after --max-requests\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--event-loop", argv[i]) == 0) {
+            event_loop = 1;
         } else if (strcmp("--help", argv[i]) == 0) {
             exit_with_usage();
         } else {
@@ -0,0 +1,279 @@
+/* End-to-end checks of httpserver, run against ./httpserver serving files/
+ * in each of its modes. Run with no arguments for all of them, or name the
+ * ones to run. */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_PORT 18400
+#define IDLE_CLIENTS 3
+#define PROMPT_MS 1000
+#define SHRINK_FILE "files/shrink_test.bin"
+#define SHRINK_SIZE (8 << 20)
+
+struct mode {
+    const char *name;
+    char *args[4];
+    int keep_alive; /* Whether it keeps connections open between requests */
+};
+
+static const struct mode modes[] = {
+    {"single", {NULL}, 0},
+    {"threads", {"--num-threads", "2", NULL}, 1},
+    {"event-loop", {"--event-loop", NULL}, 1},
+};
+
+static pid_t server;
+static int port = TEST_PORT;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int connect_server() {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Starts the server in the mode on a port of its own and waits until it
+ * takes connections */
+static int start_server(const struct mode *mode) {
+    char port_string[16];
+    snprintf(port_string, sizeof(port_string), "%d", ++port);
+    char *argv[16] = {"./httpserver", "--files", "files", "--port", port_string, "--keep-alive-timeout", "5"};
+    int argc = 7;
+    for (int i = 0; mode->args[i] != NULL; i++) {
+        argv[argc++] = mode->args[i];
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    server = fork();
+    if (server == 0) {
+        freopen("/dev/null", "w", stdout);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = connect_server();
+        if (fd != -1) {
+            close(fd);
+            return 1;
+        }
+        usleep(20000);
+    }
+    return 0;
+}
+
+static void stop_server() {
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+}
+
+static int send_string(int fd, const char *data) {
+    size_t length = strlen(data);
+    while (length > 0) {
+        ssize_t sent = write(fd, data, length);
+        if (sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+/* Reads one response whose body has a Content-Length, waiting at most
+ * timeout_ms in all. Returns its status, or 0 if it did not come in time
+ * or the connection closed first. Bytes past it are dropped; with no_body
+ * (the answer to a HEAD) the response ends with its headers. */
+static int read_response_body(int fd, int timeout_ms, int no_body) {
+    char buffer[65536];
+    size_t size = 0;
+    long long deadline = now_ms() + timeout_ms;
+    char *body = NULL;
+    size_t length = 0;
+    while (body == NULL || size < (size_t) (body - buffer) + length) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        long long wait = deadline - now_ms();
+        if (wait <= 0 || poll(&pfd, 1, (int) wait) != 1) {
+            return 0;
+        }
+        ssize_t got = read(fd, buffer + size, sizeof(buffer) - 1 - size);
+        if (got <= 0) {
+            return 0;
+        }
+        size += got;
+        buffer[size] = '\0';
+        if (body == NULL && (body = strstr(buffer, "\r\n\r\n")) != NULL) {
+            body += 4;
+            char *header = strstr(buffer, "Content-Length: ");
+            if (header == NULL || header > body) {
+                return 0;
+            }
+            length = no_body ? 0 : strtoul(header + 16, NULL, 10);
+        }
+    }
+    if (size > (size_t) (body - buffer) + length) {
+        return 0;
+    }
+    int status = 0;
+    sscanf(buffer, "HTTP/1.%*d %d", &status);
+    return status;
+}
+
+static int read_response(int fd, int timeout_ms) {
+    return read_response_body(fd, timeout_ms, 0);
+}
+
+/* Whether the server closes the connection within timeout_ms, with nothing
+ * more to read first */
+static int closed_within(int fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char byte;
+    return poll(&pfd, 1, timeout_ms) == 1 && read(fd, &byte, 1) == 0;
+}
+
+/* Clients that keep their connections open after a request must not stop
+ * a new client from being served */
+static int idle_test(const struct mode *mode) {
+    int idle[IDLE_CLIENTS];
+    for (int i = 0; i < IDLE_CLIENTS; i++) {
+        idle[i] = connect_server();
+        if (idle[i] == -1 || !send_string(idle[i], "GET / HTTP/1.1\r\nHost: test\r\n\r\n") ||
+            read_response(idle[i], PROMPT_MS) != 200) {
+            return 0;
+        }
+    }
+
+    int fd = connect_server();
+    long long start = now_ms();
+    int status = fd != -1 && send_string(fd, "GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+                 ? read_response(fd, PROMPT_MS) : 0;
+    if (status != 200) {
+        printf("  %s: new client not served within %d ms with %d idle clients (%lld ms)\n", mode->name, PROMPT_MS,
+               IDLE_CLIENTS, now_ms() - start);
+    }
+    close(fd);
+    for (int i = 0; i < IDLE_CLIENTS; i++) {
+        close(idle[i]);
+    }
+    return status == 200;
+}
+
+/* A HEAD gets the headers of the GET but no body: the server either closes
+ * right after them or answers the next request on the same connection */
+static int head_test(const struct mode *mode) {
+    int fd = connect_server();
+    int ok = fd != -1 && send_string(fd, "HEAD / HTTP/1.1\r\nHost: test\r\n\r\n") &&
+             read_response_body(fd, PROMPT_MS, 1) == 200;
+    if (ok && mode->keep_alive) {
+        ok = send_string(fd, "GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n") &&
+             read_response(fd, PROMPT_MS) == 200;
+    }
+    ok = ok && closed_within(fd, PROMPT_MS);
+    if (!ok) {
+        printf("  %s: HEAD answered with a body or left the connection unusable\n", mode->name);
+    }
+    close(fd);
+    return ok;
+}
+
+/* Methods other than GET and HEAD get a 501 and the connection closed */
+static int method_test(const struct mode *mode) {
+    int fd = connect_server();
+    int ok = fd != -1 && send_string(fd, "POST / HTTP/1.1\r\nHost: test\r\n\r\n") &&
+             read_response(fd, PROMPT_MS) == 501 && closed_within(fd, PROMPT_MS);
+    if (!ok) {
+        printf("  %s: POST not answered with 501 and a close\n", mode->name);
+    }
+    close(fd);
+    return ok;
+}
+
+/* A file that shrinks while it is being sent leaves its response short;
+ * the server must close the connection rather than wait on it for another
+ * request the client cannot tell apart from the rest of the body */
+static int shrink_test(const struct mode *mode) {
+    int file = open(SHRINK_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = file != -1 && ftruncate(file, SHRINK_SIZE) == 0;
+    int fd = ok ? connect_server() : -1;
+    ok = ok && fd != -1 && send_string(fd, "GET /shrink_test.bin HTTP/1.1\r\nHost: test\r\n\r\n");
+
+    /* Let the socket fill before the file goes */
+    usleep(200000);
+    ok = ok && ftruncate(file, 0) == 0;
+
+    size_t received = 0;
+    long long deadline = now_ms() + PROMPT_MS;
+    char buffer[65536];
+    while (ok) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        long long wait = deadline - now_ms();
+        ssize_t got = wait > 0 && poll(&pfd, 1, (int) wait) == 1 ? read(fd, buffer, sizeof(buffer)) : -1;
+        if (got <= 0) {
+            ok = got == 0 && received < SHRINK_SIZE;
+            break;
+        }
+        received += got;
+    }
+    if (!ok) {
+        printf("  %s: connection not closed after a short response (%zu bytes)\n", mode->name, received);
+    }
+    close(fd);
+    close(file);
+    unlink(SHRINK_FILE);
+    return ok;
+}
+
+struct test {
+    const char *name;
+    int (*run)(const struct mode *mode);
+};
+
+static const struct test tests[] = {
+    {"idle", idle_test},
+    {"head", head_test},
+    {"method", method_test},
+    {"shrink", shrink_test},
+};
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    int failed = 0;
+    size_t count = sizeof(tests) / sizeof(tests[0]);
+    for (size_t t = 0; t < count; t++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], tests[t].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            int ok = start_server(&modes[m]) && tests[t].run(&modes[m]);
+            stop_server();
+            printf("%s test (%s) %s\n", tests[t].name, modes[m].name, ok ? "successful!" : "failed!");
+            failed |= !ok;
+        }
+    }
+    return failed;
+}
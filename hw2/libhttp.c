@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,57 +17,231 @@ void http_fatal_error(char *message) {
 }
 
 struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
-
   char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
   if (!read_buffer) http_fatal_error("Malloc failed");
 
   int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_start, *read_end;
-  size_t read_size;
-
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
+  read_buffer[bytes_read > 0 ? bytes_read : 0] = '\0'; /* Always null-terminate. */
+
+  struct http_request *request = http_request_parse_string(read_buffer);
   free(read_buffer);
+  return request;
+}
+
+struct http_request *http_request_parse_string(char *read_buffer) {
+  struct http_parser parser;
+  size_t size = strlen(read_buffer);
+  http_parser_init(&parser, read_buffer, size);
+  parser.size = size;
+  if (http_parser_finish(&parser) != HTTP_PARSE_DONE) return NULL;
+
+  struct http_request *request = calloc(1, sizeof(struct http_request));
+  if (!request) http_fatal_error("Malloc failed");
+  request->method = strndup(parser.method.data, parser.method.length);
+  request->path = strndup(parser.path.data, parser.path.length);
+  request->version = strndup(parser.version.data, parser.version.length);
+  if (!request->method || !request->path || !request->version) http_fatal_error("Malloc failed");
+  request->keep_alive = parser.keep_alive;
+  return request;
+}
+
+enum {
+  HTTP_PARSER_REQUEST_LINE,
+  HTTP_PARSER_HEADERS,
+  HTTP_PARSER_BODY,
+  HTTP_PARSER_DONE,
+  HTTP_PARSER_ERROR,
+};
+
+/* Everything but the headers array, which header_count covers */
+static void http_parser_reset(struct http_parser *parser) {
+  parser->offset = parser->scanned = 0;
+  parser->state = HTTP_PARSER_REQUEST_LINE;
+  parser->method = parser->path = parser->version = parser->body = (struct http_slice) {NULL, 0};
+  parser->header_count = 0;
+  parser->content_length = parser->request_size = 0;
+  parser->keep_alive = 0;
+}
+
+void http_parser_init(struct http_parser *parser, char *buffer, size_t capacity) {
+  parser->buffer = buffer;
+  parser->capacity = capacity;
+  parser->size = 0;
+  http_parser_reset(parser);
+}
+
+/* "[A-Z]+ [^ ]+( [^ ]*)?.*", as the request line always was */
+static int http_parse_request_line(struct http_parser *parser, char *line, size_t length) {
+  char *end = line + length;
+  char *read_end = line;
+
+  while (read_end < end && *read_end >= 'A' && *read_end <= 'Z') read_end++;
+  parser->method = (struct http_slice) {line, read_end - line};
+  if (parser->method.length == 0 || read_end == end || *read_end != ' ') return 0;
+  read_end++;
+
+  char *path = read_end;
+  while (read_end < end && *read_end != ' ') read_end++;
+  parser->path = (struct http_slice) {path, read_end - path};
+  if (parser->path.length == 0) return 0;
+
+  if (read_end < end) read_end++;
+  char *version = read_end;
+  while (read_end < end && *read_end != ' ') read_end++;
+  parser->version = (struct http_slice) {version, read_end - version};
+  return 1;
+}
+
+static void http_trim(struct http_slice *slice) {
+  while (slice->length > 0 && (*slice->data == ' ' || *slice->data == '\t')) {
+    slice->data++;
+    slice->length--;
+  }
+  while (slice->length > 0 && (slice->data[slice->length - 1] == ' ' || slice->data[slice->length - 1] == '\t')) {
+    slice->length--;
+  }
+}
+
+/* "Name: value". Headers past HTTP_MAX_HEADERS are checked but not kept. */
+static int http_parse_header(struct http_parser *parser, char *line, size_t length) {
+  char *colon = memchr(line, ':', length);
+  if (!colon || colon == line) return 0;
+  if (parser->header_count == HTTP_MAX_HEADERS) return 1;
+
+  struct http_header *header = &parser->headers[parser->header_count++];
+  header->name = (struct http_slice) {line, colon - line};
+  header->value = (struct http_slice) {colon + 1, line + length - colon - 1};
+  http_trim(&header->value);
+  return 1;
+}
+
+/* Whether the comma-separated list in slice has token, ignoring case */
+static int http_has_token(struct http_slice *slice, char *token) {
+  size_t token_length = strlen(token);
+  char *read_end = slice->data;
+  char *end = slice->data + slice->length;
+  while (read_end < end) {
+    char *comma = memchr(read_end, ',', end - read_end);
+    struct http_slice item = {read_end, (comma ? comma : end) - read_end};
+    http_trim(&item);
+    if (item.length == token_length && strncasecmp(item.data, token, token_length) == 0) return 1;
+    read_end = comma ? comma + 1 : end;
+  }
+  return 0;
+}
+
+/* Works out what the headers mean for the connection once they are in */
+static int http_end_head(struct http_parser *parser) {
+  /* HTTP/1.1 connections stay open unless the client says otherwise,
+   * older ones only if it asks */
+  parser->keep_alive = parser->version.length == 8 && memcmp(parser->version.data, "HTTP/1.1", 8) == 0;
+  struct http_slice *connection = http_parser_header(parser, "Connection");
+  if (connection && http_has_token(connection, "close")) parser->keep_alive = 0;
+  else if (connection && http_has_token(connection, "keep-alive")) parser->keep_alive = 1;
+
+  /* A body has to be skipped to find the next request, which cannot be
+   * done for a chunked one */
+  if (http_parser_header(parser, "Transfer-Encoding")) return 0;
+  struct http_slice *content_length = http_parser_header(parser, "Content-Length");
+  if (content_length) {
+    if (content_length->length == 0 || content_length->length > 18) return 0;
+    for (size_t i = 0; i < content_length->length; i++) {
+      if (content_length->data[i] < '0' || content_length->data[i] > '9') return 0;
+      parser->content_length = parser->content_length * 10 + content_length->data[i] - '0';
+    }
+  }
+  return 1;
+}
+
+static int http_parser_step(struct http_parser *parser) {
+  /* Whole lines at a time, from the first one not yet parsed */
+  while (parser->state == HTTP_PARSER_REQUEST_LINE || parser->state == HTTP_PARSER_HEADERS) {
+    char *line = parser->buffer + parser->offset;
+    char *end = memchr(parser->buffer + parser->scanned, '\n', parser->size - parser->scanned);
+    if (!end) {
+      parser->scanned = parser->size;
+      return HTTP_PARSE_INCOMPLETE;
+    }
+    parser->offset = parser->scanned = end + 1 - parser->buffer;
+
+    size_t length = end - line;
+    if (length > 0 && line[length - 1] == '\r') length--;
+    int ok;
+    if (parser->state == HTTP_PARSER_REQUEST_LINE) {
+      ok = http_parse_request_line(parser, line, length);
+      parser->state = HTTP_PARSER_HEADERS;
+    } else if (length == 0) {
+      ok = http_end_head(parser);
+      parser->state = HTTP_PARSER_BODY;
+    } else {
+      ok = http_parse_header(parser, line, length);
+    }
+    if (!ok) {
+      parser->state = HTTP_PARSER_ERROR;
+      return HTTP_PARSE_ERROR;
+    }
+  }
+
+  if (parser->state == HTTP_PARSER_BODY) {
+    if (parser->size - parser->offset < parser->content_length) return HTTP_PARSE_INCOMPLETE;
+    parser->body = (struct http_slice) {parser->buffer + parser->offset, parser->content_length};
+    parser->request_size = parser->offset + parser->content_length;
+    parser->state = HTTP_PARSER_DONE;
+  }
+  return parser->state == HTTP_PARSER_DONE ? HTTP_PARSE_DONE : HTTP_PARSE_ERROR;
+}
+
+int http_parser_parse(struct http_parser *parser) {
+  int result = http_parser_step(parser);
+  /* No room left to finish the request in */
+  if (result == HTTP_PARSE_INCOMPLETE &&
+      (parser->size == parser->capacity || parser->capacity - parser->offset < parser->content_length)) {
+    parser->state = HTTP_PARSER_ERROR;
+    result = HTTP_PARSE_ERROR;
+  }
+  return result;
+}
+
+int http_parser_finish(struct http_parser *parser) {
+  int result = http_parser_step(parser);
+  if (result != HTTP_PARSE_INCOMPLETE) return result;
+
+  /* A request line is enough from a client that sends nothing more, as
+   * it always was; a body cut short is not */
+  if (parser->state == HTTP_PARSER_HEADERS && http_end_head(parser) && parser->content_length == 0) {
+    parser->request_size = parser->size;
+    parser->state = HTTP_PARSER_DONE;
+    return HTTP_PARSE_DONE;
+  }
+  parser->state = HTTP_PARSER_ERROR;
+  return HTTP_PARSE_ERROR;
+}
+
+void http_parser_next(struct http_parser *parser) {
+  size_t used = parser->state == HTTP_PARSER_DONE ? parser->request_size : parser->size;
+  size_t left = parser->size - used;
+  if (left > 0) memmove(parser->buffer, parser->buffer + used, left);
+  parser->size = left;
+  http_parser_reset(parser);
+}
+
+struct http_slice *http_parser_header(struct http_parser *parser, char *name) {
+  size_t length = strlen(name);
+  for (int i = 0; i < parser->header_count; i++) {
+    struct http_header *header = &parser->headers[i];
+    if (header->name.length == length && strncasecmp(header->name.data, name, length) == 0) {
+      return &header->value;
+    }
+  }
   return NULL;
+}
 
+void http_request_free(struct http_request *request) {
+  if (!request) return;
+  free(request->method);
+  free(request->path);
+  free(request->version);
+  free(request);
 }
 
 char* http_get_response_message(int status_code) {
@@ -89,18 +266,25 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 501:
+      return "Not Implemented";
+    case 502:
+      return "Bad Gateway";
     default:
       return "Internal Server Error";
   }
 }
 
+#define HTTP_STATUS_LINE "HTTP/1.1 %d %s\r\n"
+#define HTTP_HEADER_LINE "%s: %s\r\n"
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
+  dprintf(fd, HTTP_STATUS_LINE, status_code,
       http_get_response_message(status_code));
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  dprintf(fd, HTTP_HEADER_LINE, key, value);
 }
 
 void http_end_headers(int fd) {
@@ -111,15 +295,71 @@ void http_send_string(int fd, char *data) {
   http_send_data(fd, data, strlen(data));
 }
 
-void http_send_data(int fd, char *data, size_t size) {
+int http_send_data(int fd, char *data, size_t size) {
   ssize_t bytes_sent;
   while (size > 0) {
     bytes_sent = write(fd, data, size);
-    if (bytes_sent < 0)
-      return;
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent <= 0)
+      return -1;
     size -= bytes_sent;
     data += bytes_sent;
   }
+  return 0;
+}
+
+void http_buffer_reserve(struct http_buffer *buffer, size_t size) {
+  if (buffer->size + size <= buffer->capacity) return;
+  size_t capacity = buffer->capacity ? buffer->capacity : 256;
+  while (capacity < buffer->size + size) capacity *= 2;
+  buffer->data = realloc(buffer->data, capacity);
+  if (!buffer->data) http_fatal_error("Malloc failed");
+  buffer->capacity = capacity;
+}
+
+void http_buffer_printf(struct http_buffer *buffer, char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (length < 0) return;
+
+  /* One more for the terminator vsnprintf writes */
+  http_buffer_reserve(buffer, length + 1);
+  va_start(args, format);
+  vsnprintf(buffer->data + buffer->size, length + 1, format, args);
+  va_end(args);
+  buffer->size += length;
+}
+
+void http_buffer_start_response(struct http_buffer *buffer, int status_code) {
+  http_buffer_printf(buffer, HTTP_STATUS_LINE, status_code,
+      http_get_response_message(status_code));
+}
+
+void http_buffer_add_header(struct http_buffer *buffer, char *key, char *value) {
+  http_buffer_printf(buffer, HTTP_HEADER_LINE, key, value);
+}
+
+void http_buffer_end_headers(struct http_buffer *buffer) {
+  http_buffer_add_data(buffer, "\r\n", 2);
+}
+
+void http_buffer_add_string(struct http_buffer *buffer, char *data) {
+  http_buffer_add_data(buffer, data, strlen(data));
+}
+
+void http_buffer_add_data(struct http_buffer *buffer, char *data, size_t size) {
+  http_buffer_reserve(buffer, size);
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+void http_buffer_free(struct http_buffer *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->size = buffer->capacity = 0;
 }
 
 char *http_get_mime_type(char *file_name) {
@@ -20,24 +20,115 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+
 /*
  * Functions for parsing an HTTP request.
  */
 struct http_request {
   char *method;
   char *path;
+  char *version;
+  int keep_alive; /* Whether the client wants the connection kept open */
 };
 
 struct http_request *http_request_parse(int fd);
+struct http_request *http_request_parse_string(char *buffer);
+void http_request_free(struct http_request *request);
+
+/*
+ * Incremental parser for a connection's requests, for callers that read
+ * the socket themselves:
+ *
+ *     char buffer[8192];
+ *     struct http_parser parser;
+ *     http_parser_init(&parser, buffer, sizeof(buffer));
+ *
+ *     // After each read into buffer + parser.size, add the bytes to
+ *     // parser.size and call http_parser_parse until it is done.
+ *     // A client that closes early gets http_parser_finish instead.
+ *
+ *     // Answer the request from parser.method, parser.path, ...
+ *     http_parser_next(&parser);
+ *
+ * Parsing picks up where the last call stopped, so however the request is
+ * split across reads, no byte is searched twice. The pieces of
+ * a request are slices of the buffer, not copies, and stay valid until
+ * http_parser_next drops the request. That call also moves whatever
+ * follows it, the start of a pipelined request, to the front of the
+ * buffer.
+ */
+#define HTTP_MAX_HEADERS 32
+
+#define HTTP_PARSE_ERROR (-1)
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_DONE 1
+
+/* Bytes in a buffer; not null-terminated */
+struct http_slice {
+  char *data;
+  size_t length;
+};
+
+struct http_header {
+  struct http_slice name;
+  struct http_slice value;
+};
+
+struct http_parser {
+  char *buffer;
+  size_t capacity;
+  size_t size;    /* Bytes in the buffer */
+  size_t offset;  /* Start of the first line not yet parsed */
+  size_t scanned; /* End of the part of that line already searched */
+  int state;
+  struct http_slice method;
+  struct http_slice path;
+  struct http_slice version;
+  struct http_header headers[HTTP_MAX_HEADERS];
+  int header_count;
+  struct http_slice body;
+  size_t content_length;
+  size_t request_size; /* Bytes taken by the request once it is done */
+  int keep_alive;      /* Whether the client wants the connection kept open */
+};
+
+void http_parser_init(struct http_parser *parser, char *buffer, size_t capacity);
+int http_parser_parse(struct http_parser *parser);
+int http_parser_finish(struct http_parser *parser);
+void http_parser_next(struct http_parser *parser);
+struct http_slice *http_parser_header(struct http_parser *parser, char *name);
 
 /*
  * Functions for sending an HTTP response.
  */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
-void http_send_data(int fd, char *data, size_t size);
+int http_send_data(int fd, char *data, size_t size); /* -1 if it could not all be sent */
+
+/*
+ * The same, built up in memory for callers that write the bytes out
+ * themselves, such as over a non-blocking socket. Start from a zeroed
+ * struct http_buffer.
+ */
+struct http_buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+void http_buffer_start_response(struct http_buffer *buffer, int status_code);
+void http_buffer_add_header(struct http_buffer *buffer, char *key, char *value);
+void http_buffer_end_headers(struct http_buffer *buffer);
+void http_buffer_add_string(struct http_buffer *buffer, char *data);
+void http_buffer_add_data(struct http_buffer *buffer, char *data, size_t size);
+void http_buffer_printf(struct http_buffer *buffer, char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void http_buffer_reserve(struct http_buffer *buffer, size_t size);
+void http_buffer_free(struct http_buffer *buffer);
 
 /*
  * Helper function: gets the Content-Type based on a file name.
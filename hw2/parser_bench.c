@@ -0,0 +1,169 @@
+/* Micro-benchmarks for the request parser in libhttp. Run with no
+ * arguments for all of them, or name the ones to run. Exits non-zero if
+ * the parser fails on a request, as the timings would mean nothing. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+#define ROUNDS 200000
+#define PIPELINED 8
+
+/* What a browser sends for a page: a dozen headers, about 500 bytes */
+static char *REQUEST =
+        "GET /my_documents/index.html HTTP/1.1\r\n"
+        "Host: localhost:8000\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Referer: http://localhost:8000/\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: session=5f2b1c9e8d7a6b5c4d3e2f1a0b9c8d7e\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n";
+
+static char buffer[8192];
+static size_t checksum;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char *label, double elapsed, size_t requests, size_t bytes) {
+    printf("  %-28s %7.1f ns/request %8.1f MB/s\n", label, elapsed * 1e9 / requests, bytes / elapsed / 1e6);
+}
+
+/* The whole request arrives in one read, taken apart in place */
+static int bench_whole() {
+    size_t length = strlen(REQUEST);
+    memcpy(buffer, REQUEST, length);
+    struct http_parser parser;
+
+    double start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        http_parser_init(&parser, buffer, sizeof(buffer));
+        parser.size = length;
+        if (http_parser_parse(&parser) != HTTP_PARSE_DONE) {
+            return 0;
+        }
+        checksum += parser.header_count + parser.path.length;
+    }
+    report("whole, http_parser", now() - start, ROUNDS, ROUNDS * length);
+
+    /* The same request through http_request_parse_string, which copies
+     * the request line out into strings of its own */
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        struct http_request *request = http_request_parse_string(REQUEST);
+        if (request == NULL) {
+            return 0;
+        }
+        checksum += request->keep_alive;
+        http_request_free(request);
+    }
+    report("whole, http_request copy", now() - start, ROUNDS, ROUNDS * length);
+    return 1;
+}
+
+/* The request arrives a few bytes per read, and the parser is called
+ * after each one */
+static int bench_split() {
+    static const size_t chunks[] = {64, 8, 1};
+    size_t length = strlen(REQUEST);
+    struct http_parser parser;
+
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        int rounds = ROUNDS / 10;
+        double start = now();
+        for (int round = 0; round < rounds; round++) {
+            http_parser_init(&parser, buffer, sizeof(buffer));
+            int result = HTTP_PARSE_INCOMPLETE;
+            for (size_t at = 0; at < length && result == HTTP_PARSE_INCOMPLETE; at += chunks[c]) {
+                size_t chunk = length - at < chunks[c] ? length - at : chunks[c];
+                memcpy(buffer + at, REQUEST + at, chunk);
+                parser.size += chunk;
+                result = http_parser_parse(&parser);
+            }
+            if (result != HTTP_PARSE_DONE) {
+                return 0;
+            }
+            checksum += parser.header_count;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "split, %zu-byte reads", chunks[c]);
+        report(label, now() - start, rounds, rounds * length);
+    }
+    return 1;
+}
+
+/* Several requests in one read, each answered and dropped before the
+ * next, moving the rest of the buffer up every time. Includes copying
+ * them back in for the next round. */
+static int bench_pipelined() {
+    size_t length = strlen(REQUEST);
+    if (PIPELINED * length > sizeof(buffer)) {
+        return 0;
+    }
+    for (int i = 0; i < PIPELINED; i++) {
+        memcpy(buffer + i * length, REQUEST, length);
+    }
+    struct http_parser parser;
+
+    int rounds = ROUNDS / PIPELINED;
+    double start = now();
+    for (int round = 0; round < rounds; round++) {
+        http_parser_init(&parser, buffer, sizeof(buffer));
+        parser.size = PIPELINED * length;
+        for (int i = 0; i < PIPELINED; i++) {
+            if (http_parser_parse(&parser) != HTTP_PARSE_DONE) {
+                return 0;
+            }
+            checksum += parser.path.length;
+            http_parser_next(&parser);
+        }
+        /* Put back what next moved, for the next round */
+        for (int i = 0; i < PIPELINED; i++) {
+            memcpy(buffer + i * length, REQUEST, length);
+        }
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "pipelined, %d per read", PIPELINED);
+    report(label, now() - start, rounds * PIPELINED, rounds * PIPELINED * length);
+    return 1;
+}
+
+struct bench {
+    const char *name;
+    int (*run)(); /* 0 if a request failed to parse */
+};
+
+static const struct bench benches[] = {
+    {"whole", bench_whole},
+    {"split", bench_split},
+    {"pipelined", bench_pipelined},
+};
+
+int main(int argc, char **argv) {
+    printf("request parser, %zu-byte request with %d rounds\n", strlen(REQUEST), ROUNDS);
+    int failed = 0;
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    for (size_t i = 0; i < count; i++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], benches[i].name) == 0;
+        }
+        if (selected && !benches[i].run()) {
+            printf("  %s: request failed to parse\n", benches[i].name);
+            failed = 1;
+        }
+    }
+    return failed || checksum == 0;
+}
@@ -0,0 +1,242 @@
+/* Checks of the request parser in libhttp: requests fed to it a byte at a
+ * time and several to a read, and requests it has to turn down. Run with
+ * no arguments for all of them, or name the ones to run. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libhttp.h"
+
+#define MAX_EXPECTED_HEADERS 4
+
+/* What the parser should make of a request */
+struct expected {
+    char *method;
+    char *path;
+    char *version;
+    char *headers[MAX_EXPECTED_HEADERS][2];
+    char *body;
+    int keep_alive;
+};
+
+/* Three requests one after another as a client pipelining them sends them,
+ * then the start of a fourth */
+static char *PIPELINE =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: localhost:8000\r\n"
+        "Accept:  text/html \r\n"
+        "\r\n"
+        "POST /form HTTP/1.1\r\n"
+        "Host: localhost:8000\r\n"
+        "Content-Length: 11\r\n"
+        "\r\n"
+        "name=parser"
+        "HEAD /my_documents/ HTTP/1.0\n"
+        "Connection: keep-alive\n"
+        "\n"
+        "GET /next HT";
+
+static char *PIPELINE_REST = "GET /next HT";
+
+static const struct expected PIPELINE_REQUESTS[] = {
+    {"GET", "/index.html", "HTTP/1.1", {{"Host", "localhost:8000"}, {"Accept", "text/html"}}, "", 1},
+    {"POST", "/form", "HTTP/1.1", {{"Host", "localhost:8000"}, {"Content-Length", "11"}}, "name=parser", 1},
+    {"HEAD", "/my_documents/", "HTTP/1.0", {{"Connection", "keep-alive"}}, "", 1},
+};
+
+#define PIPELINE_COUNT (sizeof(PIPELINE_REQUESTS) / sizeof(PIPELINE_REQUESTS[0]))
+
+static int slice_equals(struct http_slice *slice, char *text) {
+    return slice->length == strlen(text) && memcmp(slice->data, text, slice->length) == 0;
+}
+
+static int check_slice(char *what, struct http_slice *slice, char *text) {
+    if (!slice_equals(slice, text)) {
+        printf("  %s is \"%.*s\", not \"%s\"\n", what, (int) slice->length, slice->data, text);
+        return 0;
+    }
+    return 1;
+}
+
+/* Whether the parser has the request it should, reporting what differs */
+static int check_request(struct http_parser *parser, const struct expected *expected) {
+    int ok = check_slice("method", &parser->method, expected->method) &&
+             check_slice("path", &parser->path, expected->path) &&
+             check_slice("version", &parser->version, expected->version) &&
+             check_slice("body", &parser->body, expected->body);
+
+    int count = 0;
+    while (count < MAX_EXPECTED_HEADERS && expected->headers[count][0] != NULL) {
+        struct http_slice *value = http_parser_header(parser, expected->headers[count][0]);
+        if (value == NULL) {
+            printf("  no %s header\n", expected->headers[count][0]);
+            return 0;
+        }
+        ok = ok && check_slice(expected->headers[count][0], value, expected->headers[count][1]);
+        count++;
+    }
+    if (ok && parser->header_count != count) {
+        printf("  %d headers, not %d\n", parser->header_count, count);
+        return 0;
+    }
+    if (ok && parser->keep_alive != expected->keep_alive) {
+        printf("  keep_alive is %d, not %d\n", parser->keep_alive, expected->keep_alive);
+        return 0;
+    }
+    return ok;
+}
+
+/* Feeds the pipeline in reads of chunk bytes, answering each request as
+ * soon as the parser has it, and checks what is left at the end */
+static int feed_pipeline(size_t chunk) {
+    char buffer[1024];
+    struct http_parser parser;
+    http_parser_init(&parser, buffer, sizeof(buffer));
+
+    size_t length = strlen(PIPELINE);
+    size_t parsed = 0;
+    for (size_t at = 0; at < length; at += chunk) {
+        size_t size = length - at < chunk ? length - at : chunk;
+        memcpy(buffer + parser.size, PIPELINE + at, size);
+        parser.size += size;
+
+        int result;
+        while ((result = http_parser_parse(&parser)) == HTTP_PARSE_DONE) {
+            if (parsed == PIPELINE_COUNT || !check_request(&parser, &PIPELINE_REQUESTS[parsed])) {
+                printf("  request %zu wrong with %zu-byte reads\n", parsed + 1, chunk);
+                return 0;
+            }
+            if (chunk == 1 && parser.request_size != parser.size) {
+                printf("  request %zu done %zu bytes early\n", parsed + 1, parser.request_size - parser.size);
+                return 0;
+            }
+            parsed++;
+            http_parser_next(&parser);
+        }
+        if (result != HTTP_PARSE_INCOMPLETE) {
+            printf("  request %zu failed with %zu-byte reads\n", parsed + 1, chunk);
+            return 0;
+        }
+    }
+
+    if (parsed != PIPELINE_COUNT) {
+        printf("  %zu requests, not %zu, with %zu-byte reads\n", parsed, PIPELINE_COUNT, chunk);
+        return 0;
+    }
+    if (parser.size != strlen(PIPELINE_REST) || memcmp(buffer, PIPELINE_REST, parser.size) != 0) {
+        printf("  \"%.*s\" left with %zu-byte reads, not \"%s\"\n", (int) parser.size, buffer, chunk, PIPELINE_REST);
+        return 0;
+    }
+    return 1;
+}
+
+/* Every request is done on the byte that ends it and not before */
+static int bytewise_test() {
+    return feed_pipeline(1);
+}
+
+/* All the requests in one read, and reads that split them anywhere */
+static int pipelined_test() {
+    static const size_t chunks[] = {1024, 64, 7, 3};
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        if (!feed_pipeline(chunks[c])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Parses text in a buffer of capacity bytes, as much of it as fits, and
+ * returns the result */
+static int parse_in(char *text, size_t capacity) {
+    char buffer[1024];
+    struct http_parser parser;
+    http_parser_init(&parser, buffer, capacity);
+    size_t length = strlen(text);
+    parser.size = length < capacity ? length : capacity;
+    memcpy(buffer, text, parser.size);
+    return http_parser_parse(&parser);
+}
+
+/* A request that cannot fit in the buffer fails once the buffer is full,
+ * rather than waiting for room that will never come */
+static int oversized_test() {
+    char *request = "GET / HTTP/1.1\r\nHost: localhost\r\nCookie: a-long-cookie-that-will-not-fit\r\n\r\n";
+    int ok = 1;
+    if (parse_in(request, 48) != HTTP_PARSE_ERROR) {
+        printf("  headers larger than the buffer not turned down\n");
+        ok = 0;
+    }
+    if (parse_in(request, strlen(request)) != HTTP_PARSE_DONE) {
+        printf("  headers that just fit the buffer turned down\n");
+        ok = 0;
+    }
+    if (parse_in("POST / HTTP/1.1\r\nContent-Length: 4096\r\n\r\nbody", 1024) != HTTP_PARSE_ERROR) {
+        printf("  body larger than the buffer not turned down\n");
+        ok = 0;
+    }
+    return ok;
+}
+
+/* Requests the parser must turn down however they arrive */
+static int malformed_test() {
+    static char *requests[] = {
+        "get / HTTP/1.1\r\n\r\n",
+        "GET\r\n\r\n",
+        "G3T / HTTP/1.1\r\n\r\n",
+        " / HTTP/1.1\r\n\r\n",
+        "GET  HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost localhost\r\n\r\n",
+        "GET / HTTP/1.1\r\n: localhost\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 1234567890123456789\r\n\r\n",
+        "GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+    };
+    int ok = 1;
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        char buffer[1024];
+        struct http_parser parser;
+        http_parser_init(&parser, buffer, sizeof(buffer));
+        size_t length = strlen(requests[i]);
+        int result = HTTP_PARSE_INCOMPLETE;
+        for (size_t at = 0; at < length && result == HTTP_PARSE_INCOMPLETE; at++) {
+            buffer[parser.size++] = requests[i][at];
+            result = http_parser_parse(&parser);
+        }
+        if (result != HTTP_PARSE_ERROR) {
+            printf("  \"%.*s\" not turned down\n", (int) strcspn(requests[i], "\r"), requests[i]);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+struct test {
+    const char *name;
+    int (*run)();
+};
+
+static const struct test tests[] = {
+    {"bytewise", bytewise_test},
+    {"pipelined", pipelined_test},
+    {"oversized", oversized_test},
+    {"malformed", malformed_test},
+};
+
+int main(int argc, char **argv) {
+    int failed = 0;
+    size_t count = sizeof(tests) / sizeof(tests[0]);
+    for (size_t t = 0; t < count; t++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], tests[t].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        int ok = tests[t].run();
+        printf("%s test %s\n", tests[t].name, ok ? "successful!" : "failed!");
+        failed |= !ok;
+    }
+    return failed;
+}
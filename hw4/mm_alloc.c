@@ -1,10 +1,123 @@
+#define _GNU_SOURCE
 #include "mm_alloc.h"
 
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
 
-s_block_ptr heap_start = NULL;
+/* Guards everything below; thread caches only take it to refill or flush.
+ * It is one lock rather than one per size class: fusion, splitting and
+ * growing the heap all cross classes, and the caches already keep it off
+ * the fast path. mm_bench threads reports how often it is taken and how
+ * often that has to wait. */
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Every run of blocks from sbrk ends in a zero-size used header. This is
+ * the one at the current break, the only run that can grow or shrink. */
+s_block_ptr heap_end = NULL;
+
+/* Address range handed out by sbrk, used to vet pointers in get_block */
+char *heap_low = NULL;
+char *heap_high = NULL;
+
+/* Huge page mode, -1 until the first time the heap grows. The heap then
+ * lives in one reservation with huge_brk as its break; pages up to
+ * huge_committed are usable, and those below huge_dirty may hold data
+ * from before the break last came down. */
+int huge_pages = -1;
+char *huge_base = NULL;
+char *huge_brk = NULL;
+char *huge_committed = NULL;
+char *huge_dirty = NULL;
+char *huge_limit = NULL;
+
+/* Heads of the size-class free lists and a bitmap of the non-empty ones */
+s_block_ptr free_lists[NUM_SIZE_CLASSES];
+unsigned long long free_map[NUM_SIZE_CLASSES / 64];
+
+size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+size_t heap_chunk = DEFAULT_HEAP_CHUNK;
+size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+/* The size word also holds the state and flags. Cached blocks change state
+ * outside the heap lock while fusion may be looking at them as neighbours,
+ * so the word is only touched atomically. With the heap lock held a block
+ * no thread cache can reach is written with a plain store; flags on a
+ * neighbour, which might be cached, are changed with fetch_or/fetch_and. */
+#define LOAD_SIZE(b) __atomic_load_n(&(b)->size, __ATOMIC_RELAXED)
+#define STORE_SIZE(b, word) __atomic_store_n(&(b)->size, (word), __ATOMIC_RELAXED)
+#define BLOCK_BYTES(b) (LOAD_SIZE(b) & ~(size_t) FLAG_MASK)
+#define LOAD_STATE(b) ((int) (LOAD_SIZE(b) & STATE_MASK))
+#define HAS_FLAG(b, flag) ((LOAD_SIZE(b) & (flag)) != 0)
+#define SET_FLAG(b, flag) __atomic_fetch_or(&(b)->size, (size_t) (flag), __ATOMIC_RELAXED)
+#define CLEAR_FLAG(b, flag) __atomic_fetch_and(&(b)->size, ~(size_t) (flag), __ATOMIC_RELAXED)
+
+#define PAYLOAD_SIZE(b) (BLOCK_BYTES(b) - BLOCK_SIZE)
+#define CACHE_BLOCK_LIMIT (CACHE_LIMIT + BLOCK_SIZE)
+
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+
+/* Counters behind mm_stats. The heap ones are kept under the heap lock;
+ * the mapping ones are bumped atomically since mappings are made without
+ * it. Cache allocations are counted in each cache and summed on demand. */
+struct mm_stats heap_stats;
+
+/* Takes the heap lock, counting the times another thread already had it */
+static void lock_heap(void) {
+    if (pthread_mutex_trylock(&heap_lock) != 0) {
+        __atomic_fetch_add(&heap_stats.heap_lock_waits, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&heap_lock);
+    }
+    heap_stats.heap_locks++;
+}
+
+int stats_fd = -1;
+
+/* Thread caches by id; a block's owner field is its cache's id + 1 */
+thread_cache_ptr cache_table[MAX_THREAD_CACHES];
+unsigned int cache_count = 0;
+
+/* Caches of exited threads, handed to the next thread that needs one */
+thread_cache_ptr orphan_caches = NULL;
+
+pthread_key_t cache_key;
+pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+__thread thread_cache_ptr my_cache = NULL;
+__thread int my_cache_gone = 0;
+
+/* Heap profile. Each thread counts down the bytes it allocates and samples
+ * the allocation that takes it below zero. Live samples hang off hash
+ * buckets by address, and a free only takes profile_lock when its bucket
+ * is marked in use in profile_used, which is small enough to stay in
+ * cache. Sample slots are carved from one mapping and recycled. */
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+size_t profile_interval = 0;
+size_t profile_rate = DEFAULT_PROFILE_INTERVAL;
+profile_sample_ptr profile_buckets[1 << PROFILE_BUCKET_BITS];
+unsigned long long profile_used[(1 << PROFILE_BUCKET_BITS) / 64];
+profile_sample_ptr profile_free_samples = NULL;
+profile_sample_ptr profile_carve = NULL;
+profile_sample_ptr profile_carve_end = NULL;
+unsigned long profile_live = 0;
+unsigned long profile_dropped = 0;
+
+/* Bytes this thread has left before its next sample; the countdown only
+ * counts once it has been drawn while profiling was on */
+__thread long long sample_countdown = 0;
+__thread int sample_armed = 0;
+__thread unsigned long long sample_random = 0;
 
 
 #include "mm_alloc.h"
@@ -12,10 +125,12 @@ s_block_ptr heap_start = NULL;
 // Helper functions
 void *allocate_block(s_block_ptr block, size_t size);
 
-void *allocate_new_block(size_t size, s_block_ptr last_block);
+void *allocate_new_block(size_t size);
 
 void *realloc_existing_block(void *ptr, size_t size, s_block_ptr block);
 
+int realloc_in_place(s_block_ptr block, size_t size);
+
 // Main functions
 void *mm_malloc(size_t size);
 
@@ -23,36 +138,301 @@ void *mm_realloc(void *ptr, size_t size);
 
 void mm_free(void *ptr);
 
-// Block management functions
-s_block_ptr create_block(void *ptr, size_t size);
+void *mm_calloc(size_t count, size_t size);
+
+void *mm_memalign(size_t alignment, size_t size);
+
+void *mm_aligned_alloc(size_t alignment, size_t size);
+
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
 
-void insert_block_after(s_block_ptr prev_block, s_block_ptr new_block);
+void mm_free_batch(void **ptrs, size_t n);
+
+size_t mm_usable_size(void *ptr);
+
+int mm_config(int param, size_t value);
+
+void mm_stats(struct mm_stats *stats);
+
+void mm_stats_dump(int fd);
+
+size_t mm_trim(void);
+
+int mm_profile_dump(int fd, int format);
+
+// Block management functions
+s_block_ptr create_block(void *ptr, size_t size, int state);
 
 void update_block(s_block_ptr block, size_t size);
 
-void initialize_block(s_block_ptr block, s_block_ptr prev_block, size_t size);
+s_block_ptr next_block(s_block_ptr b);
 
-void try_fusion_with_previous(s_block_ptr b);
+s_block_ptr prev_block(s_block_ptr b);
 
-void try_fusion_with_next(s_block_ptr b);
+s_block_ptr try_fusion_with_previous(s_block_ptr b);
+
+s_block_ptr try_fusion_with_next(s_block_ptr b);
 
 void split_block(s_block_ptr b, size_t s);
 
-void *extend_heap(s_block_ptr last, size_t s);
+void shrink_block(s_block_ptr b, size_t s);
+
+char *grow_break(size_t grow);
+
+void *extend_heap(size_t s);
+
+void trim_heap(void);
+
+size_t purge_block(s_block_ptr b);
 
 s_block_ptr get_block(void *p);
 
-void fusion(s_block_ptr b);
+s_block_ptr fusion(s_block_ptr b);
+
+// Free list management functions
+int size_class(size_t size);
+
+void insert_free_block(s_block_ptr b);
+
+void remove_free_block(s_block_ptr b);
+
+s_block_ptr find_free_block(size_t size);
+
+// Shared heap functions, called with the heap lock held
+void *heap_malloc(size_t size);
+
+void heap_free(s_block_ptr block);
+
+void *heap_memalign(size_t alignment, size_t size);
+
+// Large block functions
+void *map_block(size_t size);
+
+void *map_aligned_block(size_t alignment, size_t size);
+
+void unmap_block(s_block_ptr block);
+
+void *remap_block(s_block_ptr block, size_t size);
+
+// Thread cache functions
+thread_cache_ptr get_thread_cache(void);
+
+void *cache_malloc(thread_cache_ptr cache, size_t size);
+
+void cache_free(thread_cache_ptr cache, s_block_ptr block);
+
+void refill_cache(thread_cache_ptr cache, size_t size);
+
+void drain_remote_frees(thread_cache_ptr cache);
+
+void flush_cache(thread_cache_ptr cache);
+
+void *quick_malloc(thread_cache_ptr cache, int bin);
+
+void quick_free(thread_cache_ptr cache, s_block_ptr block);
+
+void consolidate_quick(thread_cache_ptr cache);
+
+// Object pool functions
+mm_pool_ptr mm_pool_create(size_t obj_size);
+
+void *mm_pool_alloc(mm_pool_ptr pool);
+
+void mm_pool_free(mm_pool_ptr pool, void *ptr);
+
+void mm_pool_destroy(mm_pool_ptr pool);
+
+pool_slab_ptr new_slab(mm_pool_ptr pool);
+
+void release_slab(mm_pool_ptr pool, pool_slab_ptr slab);
+
+// Shared-memory heap functions
+mm_shm_ptr mm_shm_create(void *region, size_t size);
+
+mm_shm_ptr mm_shm_attach(void *region);
+
+void *mm_shm_alloc(mm_shm_ptr shm, size_t size);
+
+void mm_shm_free(mm_shm_ptr shm, void *ptr);
+
+size_t mm_shm_offset(mm_shm_ptr shm, void *ptr);
+
+void *mm_shm_pointer(mm_shm_ptr shm, size_t offset);
+
+void mm_shm_destroy(mm_shm_ptr shm);
+
+// Heap profile functions
+void profile_sample(void *ptr, size_t size);
+
+void profile_forget(void *ptr);
+
+// Arena functions
+mm_arena_ptr mm_arena_create(void *buffer, size_t size);
+
+void *mm_arena_alloc(mm_arena_ptr arena, size_t size);
+
+void mm_arena_reset(mm_arena_ptr arena);
+
+void mm_arena_destroy(mm_arena_ptr arena);
+
+void *arena_grow(mm_arena_ptr arena, size_t size);
+
+
+static size_t page_size(void) {
+    static size_t size = 0;
+    if (size == 0) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+/* Decide on huge page mode the first time the heap grows, and reserve its
+ * address space. Without the reservation the heap stays on sbrk. */
+static int use_huge_pages(void) {
+    if (huge_pages < 0) {
+        const char *env = getenv("MM_HUGE_PAGES");
+        huge_pages = env != NULL && atoi(env) != 0;
+    }
+    if (huge_pages == 0 || huge_base != NULL) {
+        return huge_pages;
+    }
+
+    char *map = mmap(NULL, HUGE_HEAP_RESERVE + HUGE_PAGE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    __atomic_fetch_add(&heap_stats.mmap_calls, 1, __ATOMIC_RELAXED);
+    if (map == MAP_FAILED) {
+        huge_pages = 0;
+        return 0;
+    }
+    char *base = (char *) (((size_t) map + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1));
+    if (base > map) {
+        munmap(map, base - map);
+    }
+    munmap(base + HUGE_HEAP_RESERVE, map + HUGE_PAGE_SIZE - base);
+    huge_base = huge_brk = huge_committed = huge_dirty = base;
+    huge_limit = base + HUGE_HEAP_RESERVE;
+    return 1;
+}
+
+/* The break of whichever area the heap lives in */
+static char *current_break(void) {
+    return use_huge_pages() ? huge_brk : sbrk(0);
+}
+
+/* sbrk for the heap: move the break by delta and return the old one, or
+ * (void *) -1. In huge page mode whole huge pages are opened up ahead of
+ * the break and closed again once it drops a huge page below them. */
+static char *move_break(intptr_t delta) {
+    heap_stats.sbrk_calls++;
+    if (!use_huge_pages()) {
+        return sbrk(delta);
+    }
+
+    char *old_brk = huge_brk;
+    if (delta > huge_limit - huge_brk) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    char *end = huge_brk + delta;
+    char *commit = (char *) (((size_t) end + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1));
+    if (commit > huge_committed) {
+        if (mprotect(huge_committed, commit - huge_committed, PROT_READ | PROT_WRITE) != 0) {
+            return (void *) -1;
+        }
+        madvise(huge_committed, commit - huge_committed, MADV_HUGEPAGE);
+        huge_committed = commit;
+    } else if (delta < 0) {
+        if (old_brk > huge_dirty) {
+            huge_dirty = old_brk;
+        }
+        if (commit < huge_committed) {
+            madvise(commit, huge_committed - commit, MADV_DONTNEED);
+            mprotect(commit, huge_committed - commit, PROT_NONE);
+            huge_committed = commit;
+            huge_dirty = huge_dirty < commit ? huge_dirty : commit;
+        }
+    }
+    huge_brk = end;
+    return old_brk;
+}
+
+/* Whole block size for a payload of size bytes, 0 if it cannot exist */
+static size_t block_size_for(size_t size) {
+    if (size > PTRDIFF_MAX - 2 * ALIGNMENT) {
+        return 0;
+    }
+    size_t bytes = ALIGN(size + BLOCK_SIZE);
+    return bytes < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : bytes;
+}
+
+/* Clear and set bits of the size word in one go, safe without the lock */
+static void set_bits(s_block_ptr b, size_t clear, size_t set) {
+    size_t old = LOAD_SIZE(b);
+    while (!__atomic_compare_exchange_n(&b->size, &old, (old & ~clear) | set, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void set_state(s_block_ptr b, int state) {
+    STORE_SIZE(b, (LOAD_SIZE(b) & ~(size_t) STATE_MASK) | state);
+}
+
+static void set_footer(s_block_ptr b) {
+    *(size_t *) ((char *) b + BLOCK_BYTES(b) - sizeof(size_t)) = BLOCK_BYTES(b);
+}
+
+/* A zeroed block still carries a list link and maybe a footer; clear them
+ * before the payload is handed out */
+static void clear_link_words(s_block_ptr b) {
+    if (HAS_FLAG(b, ZEROED)) {
+        b->prev_free = NULL;
+        *(size_t *) ((char *) b + BLOCK_BYTES(b) - sizeof(size_t)) = 0;
+    }
+}
+
+/* Turn b into a live heap block and tell the next block about it */
+static void mark_used(s_block_ptr b, int state) {
+    set_state(b, state);
+    b->magic = BLOCK_MAGIC;
+    b->owner = 0;
+    s_block_ptr next = next_block(b);
+    if (HAS_FLAG(next, PREV_FREE)) {
+        CLEAR_FLAG(next, PREV_FREE);
+    }
+}
+
+/* Turn b into a free block on the lists and tell the next block about it */
+static void mark_free(s_block_ptr b) {
+    set_state(b, BLOCK_FREE);
+    set_footer(b);
+    insert_free_block(b);
+    s_block_ptr next = next_block(b);
+    if (!HAS_FLAG(next, PREV_FREE)) {
+        SET_FLAG(next, PREV_FREE);
+    }
+}
+
+/* Write the zero-size used header that closes a run of blocks */
+static s_block_ptr write_epilogue(char *at, int prev_free) {
+    s_block_ptr end = create_block(at, 0, BLOCK_USED);
+    if (prev_free) {
+        SET_FLAG(end, PREV_FREE);
+    }
+    end->magic = 0;
+    return end;
+}
 
 
 void *allocate_block(s_block_ptr block, size_t size) {
+    remove_free_block(block);
     split_block(block, size);
-    block->is_free = 0;
-    return block->ptr;
+    clear_link_words(block);
+    mark_used(block, BLOCK_USED);
+    return block->data;
 }
 
-void *allocate_new_block(size_t size, s_block_ptr last_block) {
-    return extend_heap(last_block, size);
+void *allocate_new_block(size_t size) {
+    return extend_heap(size);
 }
 
 void *realloc_existing_block(void *ptr, size_t size, s_block_ptr block) {
@@ -60,31 +440,106 @@ void *realloc_existing_block(void *ptr, size_t size, s_block_ptr block) {
     if (new_ptr == NULL) {
         return NULL;
     }
-    size_t size_to_copy = size <= block->size ? size : block->size;
-    if (size > size_to_copy) {
-        memset(new_ptr, 0, size);
-    }
-    memcpy(new_ptr, block->ptr, size_to_copy);
-    mm_free(block->ptr);
+    size_t size_to_copy = size <= PAYLOAD_SIZE(block) ? size : PAYLOAD_SIZE(block);
+    memcpy(new_ptr, block->data, size_to_copy);
+    mm_free(block->data);
     return new_ptr;
 }
 
+int realloc_in_place(s_block_ptr block, size_t size) {
+    int resized = 1;
+    lock_heap();
+    CLEAR_FLAG(block, ZEROED);
+
+    if (size > BLOCK_BYTES(block)) {
+        /* Soak up a free neighbour first, then the break if we are on top.
+         * While the free lists could hold the block it moves instead, or a
+         * block growing at the top keeps pushing the break up past free
+         * space nothing else gets to reuse. */
+        if (my_cache != NULL && my_cache->quick_blocks != 0 && LOAD_STATE(next_block(block)) != BLOCK_FREE) {
+            /* The neighbour may only be parked in a quick bin */
+            consolidate_quick(my_cache);
+        }
+        try_fusion_with_next(block);
+        s_block_ptr next = next_block(block);
+        if (size > BLOCK_BYTES(block) && heap_stats.free_bytes < size && next == heap_end &&
+            current_break() == (char *) next + BLOCK_SIZE) {
+            size_t grow = ALIGN(size - BLOCK_BYTES(block));
+            if (grow < heap_chunk) {
+                grow = heap_chunk;
+            }
+            if (grow_break(grow) != NULL) {
+                update_block(block, BLOCK_BYTES(block) + grow);
+                heap_end = write_epilogue((char *) next + grow, 0);
+            }
+        }
+        CLEAR_FLAG(next_block(block), PREV_FREE);
+        resized = size <= BLOCK_BYTES(block);
+    }
+
+    /* Hand back whatever is spare, including anything just absorbed */
+    shrink_block(block, size);
+    if (BLOCK_BYTES(block) > CACHE_BLOCK_LIMIT) {
+        block->owner = 0;
+    }
+
+    pthread_mutex_unlock(&heap_lock);
+    return resized;
+}
+
+static int profile_bucket(void *ptr) {
+    return (int) (((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL >> (64 - PROFILE_BUCKET_BITS));
+}
+
+/* Count an allocation towards this thread's next heap profile sample.
+ * Always inlined, so the backtrace taken in profile_sample starts at the
+ * entry point the program called. */
+static inline __attribute__((always_inline)) void *profile_malloc(void *ptr, size_t size) {
+    if (ptr != NULL && (sample_countdown -= (long long) size) < 0) {
+        profile_sample(ptr, size);
+    }
+    return ptr;
+}
+
+/* Drop the sample of a block about to be freed, if it has one */
+static inline void profile_free(void *ptr) {
+    if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0) {
+        int bucket = profile_bucket(ptr);
+        if (__atomic_load_n(&profile_used[bucket / 64], __ATOMIC_RELAXED) & (1ULL << (bucket % 64))) {
+            profile_forget(ptr);
+        }
+    }
+}
+
 void *mm_malloc(size_t size) {
     if (size == 0) {
         return NULL;
     }
-    s_block_ptr current_block = heap_start;
-    s_block_ptr last_block = NULL;
 
-    while (current_block != NULL) {
-        if (current_block->is_free && current_block->size >= size) {
-            return allocate_block(current_block, size);
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        return profile_malloc(map_block(size), size);
+    }
+    size_t bytes = block_size_for(size);
+    if (bytes == 0) {
+        return NULL;
+    }
+
+    if (bytes <= SMALL_LIMIT) {
+        thread_cache_ptr cache = get_thread_cache();
+        void *ptr = cache != NULL ? quick_malloc(cache, size_class(bytes)) : NULL;
+        if (ptr != NULL) {
+            return profile_malloc(ptr, size);
+        }
+        if (cache != NULL && bytes <= CACHE_BLOCK_LIMIT) {
+            return profile_malloc(cache_malloc(cache, bytes), size);
         }
-        last_block = current_block;
-        current_block = current_block->next;
     }
 
-    return allocate_new_block(size, last_block);
+    lock_heap();
+    heap_stats.size_classes[size_class(bytes)]++;
+    void *ptr = heap_malloc(bytes);
+    pthread_mutex_unlock(&heap_lock);
+    return profile_malloc(ptr, size);
 }
 
 void *mm_realloc(void *ptr, size_t size) {
@@ -100,6 +555,22 @@ void *mm_realloc(void *ptr, size_t size) {
     if (block == NULL) {
         return NULL;
     }
+    /* Resized, the block counts as a new allocation */
+    profile_free(ptr);
+
+    /* An aligned mapping would lose its alignment if the kernel moved it */
+    int state = LOAD_STATE(block);
+    if (state == BLOCK_MAPPED && block->owner == 0 &&
+        size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        return profile_malloc(remap_block(block, size), size);
+    }
+    size_t bytes = block_size_for(size);
+    if (state == BLOCK_USED && bytes != 0 && realloc_in_place(block, bytes)) {
+        return profile_malloc(ptr, size);
+    }
+    if (state != BLOCK_USED && state != BLOCK_MAPPED) {
+        return NULL;
+    }
 
     return realloc_existing_block(ptr, size, block);
 }
@@ -112,109 +583,1868 @@ void mm_free(void *ptr) {
     if (block == NULL) {
         return;
     }
+    profile_free(ptr);
 
-    block->is_free = 1;
-    memset(block->ptr, 0, block->size);
-    fusion(block);
-}
+    int state = LOAD_STATE(block);
+    if (state == BLOCK_MAPPED) {
+        unmap_block(block);
+        return;
+    }
+    if (state != BLOCK_USED) {
+        return;
+    }
 
+    if (BLOCK_BYTES(block) <= SMALL_LIMIT) {
+        thread_cache_ptr cache = get_thread_cache();
+        if (cache != NULL && (block->owner == 0 || block->owner == cache->id + 1)) {
+            quick_free(cache, block);
+            return;
+        }
+    }
+    if (block->owner != 0) {
+        cache_free(get_thread_cache(), block);
+        return;
+    }
 
-s_block_ptr create_block(void *ptr, size_t size) {
-    s_block_ptr new_block = (s_block_ptr) ptr;
-    new_block->size = size;
-    new_block->is_free = 1;
-    new_block->next = NULL;
-    new_block->prev = NULL;
-    new_block->ptr = ptr + BLOCK_SIZE;
-    memset(new_block->ptr, 0, size);
-    return new_block;
+    lock_heap();
+    heap_free(block);
+    pthread_mutex_unlock(&heap_lock);
 }
 
-void insert_block_after(s_block_ptr prev_block, s_block_ptr new_block) {
-    if (prev_block != NULL) {
-        new_block->next = prev_block->next;
-        prev_block->next = new_block;
-    } else {
-        heap_start = new_block;
+void *mm_calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        return NULL;
+    }
+    void *ptr = mm_malloc(total);
+    if (ptr == NULL) {
+        return NULL;
     }
 
-    if (new_block->next != NULL) {
-        new_block->next->prev = new_block;
+    /* Memory straight from sbrk or mmap is already zero */
+    s_block_ptr block = get_block(ptr);
+    if (!HAS_FLAG(block, ZEROED)) {
+        memset(ptr, 0, total);
     }
-    new_block->prev = prev_block;
+    CLEAR_FLAG(block, ZEROED);
+    return ptr;
 }
 
-void update_block(s_block_ptr block, size_t size) {
-    block->size = size;
+static void dump_stats_at_exit(void) {
+    mm_stats_dump(stats_fd);
+}
+
+static void dump_stats_on_signal(int sig) {
+    mm_stats_dump(stats_fd);
+}
+
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return mm_malloc(size);
+    }
+    /* Bounding the alignment first keeps 2 * alignment from wrapping */
+    if (alignment > PTRDIFF_MAX / 4 || size == 0 || size > PTRDIFF_MAX - 2 * alignment) {
+        return NULL;
+    }
+
+    if (size + alignment >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        return profile_malloc(map_aligned_block(alignment, size), size);
+    }
+    lock_heap();
+    heap_stats.size_classes[size_class(block_size_for(size))]++;
+    void *ptr = heap_memalign(alignment, block_size_for(size));
+    pthread_mutex_unlock(&heap_lock);
+    return profile_malloc(ptr, size);
 }
 
-void initialize_block(s_block_ptr block, s_block_ptr prev_block, size_t size) {
-    block->prev = prev_block;
-    block->next = NULL;
-    block->is_free = 0;
-    block->size = size;
-    block->ptr = block + 1;
-    memset(block->ptr, 0, size);
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
 }
 
-void try_fusion_with_previous(s_block_ptr b) {
-    if (b->prev != NULL && b->prev->is_free) {
-        b->prev->size += b->size + BLOCK_SIZE;
-        b->prev->next = b->next;
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    size_t bytes = block_size_for(size);
+    size_t done = 0;
+    if (n != 0 && size != 0 && bytes != 0 && size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) &&
+        n <= (PTRDIFF_MAX / 2) / bytes) {
+        /* One search and one split for the lot: take a single region and
+         * lay the blocks out in it back to back */
+        lock_heap();
+        heap_stats.size_classes[size_class(bytes)] += n;
+        char *region = heap_malloc(bytes * n);
+        if (region != NULL) {
+            s_block_ptr block = (s_block_ptr) (region - BLOCK_SIZE);
+            size_t last = BLOCK_BYTES(block) - bytes * (n - 1);
+            size_t zeroed = LOAD_SIZE(block) & ZEROED;
+            update_block(block, n == 1 ? last : bytes);
+            out[done++] = block->data;
+            for (char *at = (char *) block + bytes; done < n; at += bytes) {
+                s_block_ptr next = create_block(at, done == n - 1 ? last : bytes, BLOCK_USED);
+                STORE_SIZE(next, LOAD_SIZE(next) | zeroed);
+                out[done++] = next->data;
+            }
+        } else {
+            heap_stats.size_classes[size_class(bytes)] -= n;
+        }
+        pthread_mutex_unlock(&heap_lock);
+        for (size_t i = 0; i < done; i++) {
+            profile_malloc(out[i], size);
+        }
+    }
 
-        if (b->next != NULL) {
-            b->next->prev = b->prev;
+    /* Too big for the heap, or the heap could not fit them together */
+    for (; done < n; done++) {
+        out[done] = mm_malloc(size);
+        if (out[done] == NULL) {
+            break;
         }
-        b = b->prev;
     }
+    return done;
 }
 
-void try_fusion_with_next(s_block_ptr b) {
-    if (b->next != NULL && b->next->is_free) {
-        b->size += b->next->size + BLOCK_SIZE;
-        b->next = b->next->next;
+static int compare_pointers(const void *a, const void *b) {
+    char *x = *(char *const *) a;
+    char *y = *(char *const *) b;
+    return (x > y) - (x < y);
+}
+
+void mm_free_batch(void **ptrs, size_t n) {
+    /* Blocks that do not go back to the shared heap are dealt with first;
+     * the rest are sorted by address, which reorders ptrs */
+    size_t heap_blocks = 0;
+    for (size_t i = 0; i < n; i++) {
+        s_block_ptr block = ptrs[i] != NULL ? get_block(ptrs[i]) : NULL;
+        if (block != NULL) {
+            profile_free(ptrs[i]);
+        }
+        if (block != NULL && LOAD_STATE(block) == BLOCK_MAPPED) {
+            unmap_block(block);
+        } else if (block != NULL && LOAD_STATE(block) == BLOCK_USED && block->owner != 0) {
+            cache_free(get_thread_cache(), block);
+        } else if (block != NULL && LOAD_STATE(block) == BLOCK_USED) {
+            ptrs[heap_blocks++] = ptrs[i];
+        }
+    }
+    qsort(ptrs, heap_blocks, sizeof(void *), compare_pointers);
 
-        if (b->next != NULL) {
-            b->next->prev = b;
+    /* Runs of neighbours become one block before they are freed, so each
+     * run costs one fusion and one free list insert */
+    lock_heap();
+    for (size_t i = 0; i < heap_blocks;) {
+        s_block_ptr block = (s_block_ptr) ((char *) ptrs[i++] - BLOCK_SIZE);
+        if (i > 1 && ptrs[i - 1] == ptrs[i - 2]) {
+            continue;
+        }
+        size_t bytes = BLOCK_BYTES(block);
+        for (; i < heap_blocks && (char *) ptrs[i] - BLOCK_SIZE == (char *) block + bytes; i++) {
+            s_block_ptr next = (s_block_ptr) ((char *) ptrs[i] - BLOCK_SIZE);
+            if (LOAD_STATE(next) != BLOCK_USED || next->owner != 0) {
+                break;
+            }
+            bytes += BLOCK_BYTES(next);
+            next->magic = 0;
         }
+        update_block(block, bytes);
+        heap_free(block);
     }
+    pthread_mutex_unlock(&heap_lock);
 }
 
-void split_block(s_block_ptr b, size_t s) {
-    if (b->size > s + BLOCK_SIZE) {
-        s_block_ptr new_block = create_block(b->ptr + s, b->size - s - BLOCK_SIZE);
-        insert_block_after(b, new_block);
-        update_block(b, s);
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    s_block_ptr block = get_block(ptr);
+    return block == NULL ? 0 : PAYLOAD_SIZE(block);
+}
+
+static void lock_profile(void) {
+    pthread_mutex_lock(&profile_lock);
+}
+
+static void unlock_profile(void) {
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Sample slots come from a mapping of their own, since taking them from
+ * the heap would mean allocating in the middle of an allocation */
+static void setup_profile(void) {
+    size_t bytes = PROFILE_MAX_SAMPLES * sizeof(struct profile_sample);
+    profile_sample_ptr samples = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED) {
+        return;
+    }
+    /* backtrace loads its unwinder on first use, which allocates */
+    void *frame;
+    backtrace(&frame, 1);
+    pthread_atfork(lock_profile, unlock_profile, unlock_profile);
+    profile_carve_end = samples + PROFILE_MAX_SAMPLES;
+    profile_carve = samples;
+}
+
+/* Gaps between samples are drawn from an exponential distribution, which
+ * makes the samples a Poisson process over the bytes allocated. A block
+ * of s bytes is then sampled with probability 1 - exp(-s / interval),
+ * which is what the estimates in the profile undo. */
+static long long next_sample_gap(size_t interval) {
+    if (sample_random == 0) {
+        sample_random = (uintptr_t) &sample_random * 0x9e3779b97f4a7c15ULL | 1;
+    }
+    sample_random ^= sample_random << 13;
+    sample_random ^= sample_random >> 7;
+    sample_random ^= sample_random << 17;
+    double uniform = ((sample_random >> 11) + 1) / 0x1p53;
+    return (long long) (-log(uniform) * interval);
+}
+
+__attribute__((noinline)) void profile_sample(void *ptr, size_t size) {
+    size_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+    if (interval == 0) {
+        sample_countdown = PROFILE_RECHECK;
+        sample_armed = 0;
+        return;
+    }
+    /* Reset before backtrace, which may allocate the first time */
+    sample_countdown = next_sample_gap(interval);
+    if (!sample_armed) {
+        sample_armed = 1;
+        return;
+    }
+
+    /* The first frame is this function's own */
+    void *frames[PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + 1) - 1;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_sample_ptr sample = profile_free_samples;
+    if (sample != NULL) {
+        profile_free_samples = sample->next;
+    } else if (profile_carve < profile_carve_end) {
+        sample = profile_carve++;
+    } else {
+        profile_dropped++;
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->depth = depth > 0 ? depth : 0;
+    memcpy(sample->frames, frames + 1, sample->depth * sizeof(void *));
+    int bucket = profile_bucket(ptr);
+    sample->next = profile_buckets[bucket];
+    profile_buckets[bucket] = sample;
+    __atomic_fetch_or(&profile_used[bucket / 64], 1ULL << (bucket % 64), __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_lock);
+}
 
-        if (b->next != NULL) {
-            b->next->prev = new_block;
+void profile_forget(void *ptr) {
+    pthread_mutex_lock(&profile_lock);
+    int bucket = profile_bucket(ptr);
+    profile_sample_ptr *link = &profile_buckets[bucket];
+    while (*link != NULL && (*link)->ptr != ptr) {
+        link = &(*link)->next;
+    }
+    profile_sample_ptr sample = *link;
+    if (sample != NULL) {
+        *link = sample->next;
+        if (profile_buckets[bucket] == NULL) {
+            __atomic_fetch_and(&profile_used[bucket / 64], ~(1ULL << (bucket % 64)), __ATOMIC_RELAXED);
         }
+        sample->next = profile_free_samples;
+        profile_free_samples = sample;
+        __atomic_store_n(&profile_live, profile_live - 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&profile_lock);
 }
 
-void *extend_heap(s_block_ptr last, size_t s) {
-    s_block_ptr new_block = (s_block_ptr) sbrk(s + BLOCK_SIZE);
-    if (new_block == (void *) -1) {
-        return NULL;
+int mm_config(int param, size_t value) {
+    switch (param) {
+        case MM_MMAP_THRESHOLD:
+            __atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+            return 0;
+        case MM_HEAP_CHUNK:
+            lock_heap();
+            heap_chunk = ALIGN(value);
+            pthread_mutex_unlock(&heap_lock);
+            return 0;
+        case MM_TRIM_THRESHOLD:
+            lock_heap();
+            trim_threshold = value;
+            pthread_mutex_unlock(&heap_lock);
+            return 0;
+        case MM_STATS_AT_EXIT:
+            /* A copy, since programs often close stderr on their way out */
+            stats_fd = fcntl((int) value, F_DUPFD_CLOEXEC, 3);
+            return atexit(dump_stats_at_exit) == 0 ? 0 : -1;
+        case MM_STATS_SIGNAL:
+            if (stats_fd < 0) {
+                stats_fd = STDERR_FILENO;
+            }
+            return signal((int) value, dump_stats_on_signal) == SIG_ERR ? -1 : 0;
+        case MM_HUGE_PAGES: {
+            /* The heap cannot move once it holds blocks */
+            lock_heap();
+            int ok = heap_low == NULL;
+            if (ok) {
+                huge_pages = value != 0;
+            }
+            pthread_mutex_unlock(&heap_lock);
+            return ok ? 0 : -1;
+        }
+        case MM_PROFILE_INTERVAL:
+            if (value != 0) {
+                pthread_once(&profile_once, setup_profile);
+                if (profile_carve == NULL) {
+                    return -1;
+                }
+                pthread_mutex_lock(&profile_lock);
+                profile_rate = value;
+                pthread_mutex_unlock(&profile_lock);
+            }
+            __atomic_store_n(&profile_interval, value, __ATOMIC_RELAXED);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+
+s_block_ptr create_block(void *ptr, size_t size, int state) {
+    s_block_ptr new_block = (s_block_ptr) ptr;
+    STORE_SIZE(new_block, size | state);
+    if (state != BLOCK_FREE) {
+        new_block->magic = BLOCK_MAGIC;
+        new_block->owner = 0;
     }
+    return new_block;
+}
 
-    insert_block_after(last, new_block);
-    initialize_block(new_block, last, s);
-    return new_block->ptr;
+void update_block(s_block_ptr block, size_t size) {
+    STORE_SIZE(block, size | (LOAD_SIZE(block) & FLAG_MASK));
 }
 
-s_block_ptr get_block(void *p) {
-    s_block_ptr current_block = heap_start;
-    while (current_block != NULL) {
-        if (current_block->ptr == p) {
-            return current_block;
+s_block_ptr next_block(s_block_ptr b) {
+    return (s_block_ptr) ((char *) b + BLOCK_BYTES(b));
+}
+
+s_block_ptr prev_block(s_block_ptr b) {
+    /* Only meaningful with PREV_FREE set: the word before b is a footer */
+    return (s_block_ptr) ((char *) b - ((size_t *) b)[-1]);
+}
+
+/* b absorbs the block after it. The absorbed header, the links behind it
+ * and b's footer all become payload; clearing them is cheap and lets a
+ * merge of two zeroed blocks stay zeroed. */
+static void merge_zeroed(s_block_ptr b, s_block_ptr absorbed, int both_zeroed) {
+    if (both_zeroed) {
+        memset((char *) absorbed - sizeof(size_t), 0, BLOCK_SIZE + 2 * sizeof(size_t));
+    } else {
+        absorbed->magic = 0;
+        CLEAR_FLAG(b, ZEROED);
+    }
+}
+
+s_block_ptr try_fusion_with_previous(s_block_ptr b) {
+    if (HAS_FLAG(b, PREV_FREE)) {
+        s_block_ptr prev = prev_block(b);
+        int both_zeroed = HAS_FLAG(prev, ZEROED) && HAS_FLAG(b, ZEROED);
+        remove_free_block(prev);
+        heap_stats.coalesces++;
+        update_block(prev, BLOCK_BYTES(prev) + BLOCK_BYTES(b));
+        merge_zeroed(prev, b, both_zeroed);
+        b = prev;
+    }
+    return b;
+}
+
+s_block_ptr try_fusion_with_next(s_block_ptr b) {
+    s_block_ptr next = next_block(b);
+    if (LOAD_STATE(next) == BLOCK_FREE) {
+        int both_zeroed = HAS_FLAG(b, ZEROED) && HAS_FLAG(next, ZEROED);
+        remove_free_block(next);
+        heap_stats.coalesces++;
+        update_block(b, BLOCK_BYTES(b) + BLOCK_BYTES(next));
+        merge_zeroed(b, next, both_zeroed);
+    }
+    return b;
+}
+
+void split_block(s_block_ptr b, size_t s) {
+    if (BLOCK_BYTES(b) >= s + MIN_BLOCK_SIZE) {
+        s_block_ptr new_block = create_block((char *) b + s, BLOCK_BYTES(b) - s, BLOCK_FREE);
+        if (HAS_FLAG(b, ZEROED)) {
+            SET_FLAG(new_block, ZEROED);
         }
-        current_block = current_block->next;
+        update_block(b, s);
+        mark_free(new_block);
     }
-    return NULL;
 }
 
-void fusion(s_block_ptr b) {
-    try_fusion_with_previous(b);
-    try_fusion_with_next(b);
+void shrink_block(s_block_ptr b, size_t s) {
+    if (BLOCK_BYTES(b) < s + MIN_BLOCK_SIZE) {
+        return;
+    }
+    split_block(b, s);
+
+    /* The split-off tail may sit right before another free block */
+    s_block_ptr tail = next_block(b);
+    remove_free_block(tail);
+    mark_free(try_fusion_with_next(tail));
+    trim_heap();
+}
+
+/* Move the break up by grow bytes and return the old break. Pages past the
+ * old break come from the kernel zeroed, but the rest of the page it sat in
+ * may hold data from before an earlier shrink, so that part is cleared; in
+ * huge page mode that is everything up to huge_dirty. */
+char *grow_break(size_t grow) {
+    char *old_brk = move_break(grow);
+    if (old_brk == (void *) -1) {
+        return NULL;
+    }
+    heap_stats.heap_bytes += grow;
+    size_t stale = -(size_t) old_brk & (page_size() - 1);
+    if (huge_pages > 0) {
+        stale = huge_dirty > old_brk ? huge_dirty - old_brk : 0;
+    }
+    memset(old_brk, 0, stale < grow ? stale : grow);
+    __atomic_store_n(&heap_high, old_brk + grow, __ATOMIC_RELAXED);
+    return old_brk;
+}
+
+void *extend_heap(size_t s) {
+    char *brk = current_break();
+
+    if (heap_end != NULL && (char *) heap_end + BLOCK_SIZE == brk) {
+        /* Grow the run at the break: the old end header becomes the start of
+         * the new space, or of the free block that already ends there */
+        s_block_ptr block = heap_end;
+        size_t have = 0;
+        if (HAS_FLAG(heap_end, PREV_FREE)) {
+            block = prev_block(heap_end);
+            have = BLOCK_BYTES(block);
+        }
+        size_t grow = s > have ? s - have : 0;
+        if (grow < heap_chunk) {
+            grow = heap_chunk;
+        }
+        if (grow_break(grow) == NULL) {
+            return NULL;
+        }
+
+        if (block == heap_end) {
+            create_block(block, grow, BLOCK_FREE);
+            SET_FLAG(block, ZEROED);
+        } else {
+            remove_free_block(block);
+            if (HAS_FLAG(block, ZEROED)) {
+                memset((char *) heap_end - sizeof(size_t), 0, BLOCK_SIZE + sizeof(size_t));
+            }
+            update_block(block, have + grow);
+        }
+        heap_end = write_epilogue(brk + grow - BLOCK_SIZE, 0);
+        mark_free(block);
+        return allocate_block(block, s);
+    }
+
+    /* Someone else moved the break, so start a new run of blocks */
+    size_t pad = -(size_t) brk & (ALIGNMENT - 1);
+    size_t grow = s + BLOCK_SIZE;
+    if (grow < heap_chunk) {
+        grow = heap_chunk;
+    }
+    char *start = grow_break(pad + grow);
+    if (start == NULL) {
+        return NULL;
+    }
+    start += pad;
+
+    if (heap_low == NULL) {
+        __atomic_store_n(&heap_low, start, __ATOMIC_RELAXED);
+    }
+
+    /* The whole chunk becomes one free block and the request is split off
+     * its front */
+    s_block_ptr block = create_block(start, grow - BLOCK_SIZE, BLOCK_FREE);
+    SET_FLAG(block, ZEROED);
+    heap_end = write_epilogue(start + grow - BLOCK_SIZE, 0);
+    mark_free(block);
+    return allocate_block(block, s);
+}
+
+void trim_heap(void) {
+    if (heap_end == NULL || !HAS_FLAG(heap_end, PREV_FREE)) {
+        return;
+    }
+    s_block_ptr last = prev_block(heap_end);
+    size_t bytes = BLOCK_BYTES(last);
+    if (bytes < trim_threshold || bytes <= heap_chunk + MIN_BLOCK_SIZE) {
+        return;
+    }
+    char *end = (char *) heap_end + BLOCK_SIZE;
+    if (current_break() != end) {
+        return;
+    }
+
+    /* Give back whole pages above one chunk's worth of slack */
+    size_t release = (bytes - heap_chunk - MIN_BLOCK_SIZE) & ~(page_size() - 1);
+    if (release == 0) {
+        return;
+    }
+    if (move_break(-(intptr_t) release) == (void *) -1) {
+        return;
+    }
+    heap_stats.heap_bytes -= release;
+    __atomic_store_n(&heap_high, end - release, __ATOMIC_RELAXED);
+
+    remove_free_block(last);
+    update_block(last, bytes - release);
+    heap_end = write_epilogue((char *) heap_end - release, 1);
+    set_footer(last);
+    insert_free_block(last);
+}
+
+/* Zero [start, end) of free block b, leaving its link and footer words.
+ * With release set, whole pages go back to the kernel, which hands them
+ * back as zeros, and only the ragged ends are cleared by hand. Returns the
+ * bytes given back. */
+static size_t clear_range(s_block_ptr b, char *start, char *end, int release) {
+    char *payload = b->data + sizeof(s_block_ptr);
+    char *footer = (char *) b + BLOCK_BYTES(b) - sizeof(size_t);
+    start = start > payload ? start : payload;
+    end = end < footer ? end : footer;
+    char *first = (char *) (((size_t) start + page_size() - 1) & ~(page_size() - 1));
+    char *last = (char *) ((size_t) end & ~(page_size() - 1));
+    if (!release || last <= first) {
+        memset(start, 0, end > start ? end - start : 0);
+        return 0;
+    }
+    heap_stats.madvise_calls++;
+    if (madvise(first, last - first, MADV_DONTNEED) != 0) {
+        memset(start, 0, end - start);
+        return 0;
+    }
+    memset(start, 0, first - start);
+    memset(last, 0, end - last);
+    heap_stats.purged_bytes += last - first;
+    return last - first;
+}
+
+size_t purge_block(s_block_ptr b) {
+    /* ZEROED free blocks have been purged already, or were never touched */
+    if (HAS_FLAG(b, ZEROED)) {
+        return 0;
+    }
+    size_t released = clear_range(b, b->data, (char *) b + BLOCK_BYTES(b), 1);
+    SET_FLAG(b, ZEROED);
+    return released;
+}
+
+s_block_ptr get_block(void *p) {
+    /* The header sits right before the payload; only trust it once the
+     * pointer is known to lie inside the heap, or at the start of a
+     * mapping for large blocks, and the tag checks out. */
+    char *c = p;
+    char *low = __atomic_load_n(&heap_low, __ATOMIC_RELAXED);
+    char *high = __atomic_load_n(&heap_high, __ATOMIC_RELAXED);
+    int in_heap = c >= low + BLOCK_SIZE && c < high;
+    if (((size_t) c & (ALIGNMENT - 1)) != 0) {
+        return NULL;
+    }
+    /* Outside the heap the header must share the pointer's page, except
+     * for page-aligned mapped blocks, whose header ends the page before;
+     * that page is checked to exist before it is read */
+    if (!in_heap && ((size_t) c & (page_size() - 1)) == 0 &&
+        msync(c - page_size(), page_size(), MS_ASYNC) != 0) {
+        return NULL;
+    }
+    s_block_ptr block = (s_block_ptr) (c - BLOCK_SIZE);
+    if (block->magic != BLOCK_MAGIC || LOAD_STATE(block) == BLOCK_FREE) {
+        return NULL;
+    }
+    if (!in_heap && LOAD_STATE(block) != BLOCK_MAPPED) {
+        return NULL;
+    }
+    return block;
+}
+
+s_block_ptr fusion(s_block_ptr b) {
+    b = try_fusion_with_previous(b);
+    return try_fusion_with_next(b);
+}
+
+
+int size_class(size_t size) {
+    if (size <= SMALL_LIMIT) {
+        return (int) (size / ALIGNMENT) - 2;
+    }
+    /* One class per power of two above the exact classes */
+    int msb = 63 - __builtin_clzll(size);
+    return NUM_SMALL_CLASSES + msb - __builtin_ctz(SMALL_LIMIT);
+}
+
+void insert_free_block(s_block_ptr b) {
+    int class = size_class(BLOCK_BYTES(b));
+    b->prev_free = NULL;
+    b->next_free = free_lists[class];
+    if (b->next_free != NULL) {
+        b->next_free->prev_free = b;
+    }
+    free_lists[class] = b;
+    free_map[class / 64] |= 1ULL << (class % 64);
+    heap_stats.free_bytes += BLOCK_BYTES(b);
+}
+
+void remove_free_block(s_block_ptr b) {
+    int class = size_class(BLOCK_BYTES(b));
+    if (b->prev_free != NULL) {
+        b->prev_free->next_free = b->next_free;
+    } else {
+        free_lists[class] = b->next_free;
+    }
+    if (b->next_free != NULL) {
+        b->next_free->prev_free = b->prev_free;
+    }
+    if (free_lists[class] == NULL) {
+        free_map[class / 64] &= ~(1ULL << (class % 64));
+    }
+    heap_stats.free_bytes -= BLOCK_BYTES(b);
+}
+
+s_block_ptr find_free_block(size_t size) {
+    int class = size_class(size);
+
+    /* Range classes mix sizes, so give the request's own class a short look */
+    int scanned = 0;
+    if (class >= NUM_SMALL_CLASSES) {
+        s_block_ptr b = free_lists[class];
+        for (; b != NULL && scanned < RANGE_SCAN_LIMIT; scanned++, b = b->next_free) {
+            if (BLOCK_BYTES(b) >= size) {
+                heap_stats.search_lengths[scanned + 1]++;
+                return b;
+            }
+        }
+        class++;
+    }
+
+    /* Every block in a higher non-empty class is big enough */
+    for (int word = class / 64; word < NUM_SIZE_CLASSES / 64; word++) {
+        unsigned long long bits = free_map[word];
+        if (word == class / 64) {
+            bits &= ~0ULL << (class % 64);
+        }
+        if (bits != 0) {
+            heap_stats.search_lengths[scanned + 1]++;
+            return free_lists[word * 64 + __builtin_ctzll(bits)];
+        }
+    }
+    heap_stats.search_lengths[0]++;
+    return NULL;
+}
+
+
+static size_t mapping_length(size_t size) {
+    return (size + BLOCK_SIZE + page_size() - 1) & ~(page_size() - 1);
+}
+
+void *map_block(size_t size) {
+    if (size > PTRDIFF_MAX - page_size()) {
+        return NULL;
+    }
+    size_t length = mapping_length(size);
+    s_block_ptr block = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __atomic_fetch_add(&heap_stats.mmap_calls, 1, __ATOMIC_RELAXED);
+    if (block == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_fetch_add(&heap_stats.mapped_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heap_stats.mapped_bytes, length, __ATOMIC_RELAXED);
+
+    /* Mapped blocks have no neighbours; the whole mapping is theirs */
+    create_block(block, length, BLOCK_MAPPED);
+    SET_FLAG(block, ZEROED);
+    return block->data;
+}
+
+void *map_aligned_block(size_t alignment, size_t size) {
+    /* Map enough to find an aligned payload anywhere, then unmap whatever
+     * whole pages are left before and after it */
+    size_t length = mapping_length(size + alignment);
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __atomic_fetch_add(&heap_stats.mmap_calls, 1, __ATOMIC_RELAXED);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    char *data = (char *) (((size_t) map + BLOCK_SIZE + alignment - 1) & ~(alignment - 1));
+    char *start = (char *) ((size_t) (data - BLOCK_SIZE) & ~(page_size() - 1));
+    char *end = (char *) (((size_t) data + size + page_size() - 1) & ~(page_size() - 1));
+    if (start > map) {
+        munmap(map, start - map);
+        __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+    }
+    if (end < map + length) {
+        munmap(end, map + length - end);
+        __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&heap_stats.mapped_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heap_stats.mapped_bytes, end - start, __ATOMIC_RELAXED);
+
+    s_block_ptr block = create_block(data - BLOCK_SIZE, end - (data - BLOCK_SIZE), BLOCK_MAPPED);
+    block->owner = (char *) block - start;
+    SET_FLAG(block, ZEROED);
+    return block->data;
+}
+
+void unmap_block(s_block_ptr block) {
+    char *start = (char *) block - block->owner;
+    size_t length = BLOCK_BYTES(block) + block->owner;
+    block->magic = 0;
+    __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&heap_stats.mapped_bytes, length, __ATOMIC_RELAXED);
+    munmap(start, length);
+}
+
+void *remap_block(s_block_ptr block, size_t size) {
+    /* The kernel moves the pages, so growing never copies the payload */
+    if (size > PTRDIFF_MAX - page_size()) {
+        return NULL;
+    }
+    size_t length = mapping_length(size);
+    size_t old_length = BLOCK_BYTES(block);
+    s_block_ptr new_block = mremap(block, old_length, length, MREMAP_MAYMOVE);
+    __atomic_fetch_add(&heap_stats.mremap_calls, 1, __ATOMIC_RELAXED);
+    if (new_block == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_fetch_add(&heap_stats.mapped_bytes, length - old_length, __ATOMIC_RELAXED);
+    create_block(new_block, length, BLOCK_MAPPED);
+    return new_block->data;
+}
+
+
+/* Freed payloads are left as they are unless built with MM_SECURE_FREE.
+ * Returns the ZEROED flag the freed block should carry; with no block,
+ * just says whether payloads are scrubbed. */
+static size_t scrub_block(s_block_ptr block) {
+#ifdef MM_SECURE_FREE
+    if (block != NULL) {
+        memset(block->data, 0, PAYLOAD_SIZE(block));
+    }
+    return ZEROED;
+#else
+    return 0;
+#endif
+}
+
+void *heap_malloc(size_t size) {
+    s_block_ptr block = find_free_block(size);
+    if (block == NULL && my_cache != NULL && my_cache->quick_blocks != 0) {
+        /* Before growing, see whether the blocks this thread has parked
+         * make room once they are merged */
+        consolidate_quick(my_cache);
+        block = find_free_block(size);
+    }
+    if (block != NULL) {
+        return allocate_block(block, size);
+    }
+
+    return allocate_new_block(size);
+}
+
+void *heap_memalign(size_t alignment, size_t size) {
+    /* Take enough for an aligned payload with room for a free block in
+     * front of it, then hand the front and the tail back */
+    char *ptr = heap_malloc(size + alignment + MIN_BLOCK_SIZE);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    s_block_ptr block = (s_block_ptr) (ptr - BLOCK_SIZE);
+    CLEAR_FLAG(block, ZEROED);
+
+    char *data = (char *) (((size_t) ptr + alignment - 1) & ~(alignment - 1));
+    if (data != ptr) {
+        if (data - ptr < MIN_BLOCK_SIZE) {
+            data += alignment;
+        }
+        size_t lead = data - ptr;
+        create_block(data - BLOCK_SIZE, BLOCK_BYTES(block) - lead, BLOCK_USED);
+        update_block(block, lead);
+        block->magic = 0;
+        mark_free(try_fusion_with_previous(block));
+        block = (s_block_ptr) (data - BLOCK_SIZE);
+    }
+    shrink_block(block, size);
+    return block->data;
+}
+
+void heap_free(s_block_ptr block) {
+    /* Once merged, only this block, the headers between it and its
+     * neighbours and any neighbour not already zeroed need clearing. Where
+     * a side is clean the dirty range can take the pages it shares with
+     * the neighbour as well. */
+    char *dirty = (char *) block - sizeof(size_t);
+    char *dirty_end = (char *) block + BLOCK_BYTES(block) + BLOCK_SIZE + sizeof(s_block_ptr);
+    s_block_ptr next = next_block(block);
+    if (HAS_FLAG(block, PREV_FREE) && !HAS_FLAG(prev_block(block), ZEROED)) {
+        dirty = (char *) prev_block(block);
+    } else {
+        dirty = (char *) ((size_t) dirty & ~(page_size() - 1));
+    }
+    if (LOAD_STATE(next) == BLOCK_FREE && !HAS_FLAG(next, ZEROED)) {
+        dirty_end = (char *) next + BLOCK_BYTES(next);
+    } else {
+        dirty_end = (char *) (((size_t) dirty_end + page_size() - 1) & ~(page_size() - 1));
+    }
+
+    STORE_SIZE(block, LOAD_SIZE(block) & ~(size_t) ZEROED);
+    block->magic = 0;
+    block = fusion(block);
+    mark_free(block);
+    trim_heap();
+
+    /* A block that reaches the trim threshold has its pages purged. Under
+     * MM_SECURE_FREE the payload is wiped here as well, whole pages by
+     * purging them, so that a zeroed free block still means one with no
+     * pages resident but the odd partial one at its edges. */
+    if (BLOCK_BYTES(block) >= trim_threshold || scrub_block(NULL) != 0) {
+        clear_range(block, dirty, dirty_end, 1);
+        SET_FLAG(block, ZEROED);
+    }
+}
+
+
+static void destroy_thread_cache(void *arg) {
+    thread_cache_ptr cache = arg;
+    my_cache = NULL;
+    my_cache_gone = 1;
+
+    /* Blocks still out in other threads keep pointing here, so the cache is
+     * parked rather than released and their frees queue up for whoever
+     * adopts it next. */
+    lock_heap();
+    flush_cache(cache);
+    cache->next_orphan = orphan_caches;
+    orphan_caches = cache;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void unlock_heap(void) {
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, destroy_thread_cache);
+    /* A child forked while another thread held the heap lock would
+     * inherit it locked for good, so fork waits for the lock */
+    pthread_atfork(lock_heap, unlock_heap, unlock_heap);
+}
+
+thread_cache_ptr get_thread_cache(void) {
+    if (my_cache != NULL || my_cache_gone) {
+        return my_cache;
+    }
+    pthread_once(&cache_key_once, create_cache_key);
+
+    lock_heap();
+    thread_cache_ptr cache = orphan_caches;
+    if (cache != NULL) {
+        orphan_caches = cache->next_orphan;
+    } else if (cache_count < MAX_THREAD_CACHES) {
+        cache = heap_malloc(block_size_for(sizeof(struct thread_cache)));
+        if (cache != NULL) {
+            memset(cache, 0, sizeof(struct thread_cache));
+            cache->id = cache_count;
+            cache_table[cache_count++] = cache;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (cache != NULL) {
+        my_cache = cache;
+        pthread_setspecific(cache_key, cache);
+    } else {
+        /* Out of cache slots: this thread always goes to the shared heap */
+        my_cache_gone = 1;
+    }
+    return cache;
+}
+
+void *cache_malloc(thread_cache_ptr cache, size_t size) {
+    int class = size_class(size);
+    if (cache->bins[class] == NULL && cache->remote_frees != NULL) {
+        drain_remote_frees(cache);
+    }
+    if (cache->bins[class] == NULL) {
+        refill_cache(cache, size);
+    }
+
+    s_block_ptr block = cache->bins[class];
+    if (block == NULL) {
+        /* The heap only had an oversized block to offer */
+        lock_heap();
+        void *ptr = heap_malloc(size);
+        pthread_mutex_unlock(&heap_lock);
+        return ptr;
+    }
+    cache->bins[class] = block->next_cached;
+    cache->counts[class]--;
+    /* Only the owner writes its counters, so no read-modify-write */
+    __atomic_store_n(&cache->allocs[class], cache->allocs[class] + 1, __ATOMIC_RELAXED);
+    clear_link_words(block);
+    set_bits(block, STATE_MASK, BLOCK_USED);
+    return block->data;
+}
+
+/* Push a cached block the cache owns onto its bin, spilling half the bin back to
+ * the shared heap when it gets too long */
+static void cache_push(thread_cache_ptr cache, s_block_ptr block) {
+    int class = size_class(BLOCK_BYTES(block));
+    block->next_cached = cache->bins[class];
+    cache->bins[class] = block;
+
+    if (++cache->counts[class] > CACHE_BIN_MAX) {
+        lock_heap();
+        while (cache->counts[class] > CACHE_BIN_MAX / 2) {
+            s_block_ptr spill = cache->bins[class];
+            cache->bins[class] = spill->next_cached;
+            cache->counts[class]--;
+            heap_free(spill);
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+void cache_free(thread_cache_ptr cache, s_block_ptr block) {
+    set_bits(block, STATE_MASK | ZEROED, BLOCK_CACHED | scrub_block(block));
+    if (cache != NULL && block->owner == cache->id + 1) {
+        cache_push(cache, block);
+        return;
+    }
+
+    /* Hand the block back to its owner without touching its bins */
+    thread_cache_ptr owner = cache_table[block->owner - 1];
+    s_block_ptr head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do {
+        block->next_cached = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, block, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void refill_cache(thread_cache_ptr cache, size_t size) {
+    int class = size_class(size);
+
+    /* One trip to the shared heap fills the bin for the next few requests */
+    lock_heap();
+    for (int i = 0; i < CACHE_REFILL; i++) {
+        void *ptr = heap_malloc(size);
+        if (ptr == NULL) {
+            break;
+        }
+        s_block_ptr block = get_block(ptr);
+        if (BLOCK_BYTES(block) > CACHE_BLOCK_LIMIT) {
+            heap_free(block);
+            break;
+        }
+        block->owner = cache->id + 1;
+        set_state(block, BLOCK_CACHED);
+        int block_class = size_class(BLOCK_BYTES(block));
+        block->next_cached = cache->bins[block_class];
+        cache->bins[block_class] = block;
+        cache->counts[block_class]++;
+        if (block_class != class) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void drain_remote_frees(thread_cache_ptr cache) {
+    s_block_ptr block = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        s_block_ptr next = block->next_cached;
+        cache_push(cache, block);
+        block = next;
+    }
+}
+
+void flush_cache(thread_cache_ptr cache) {
+    consolidate_quick(cache);
+    s_block_ptr block = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        s_block_ptr next = block->next_cached;
+        heap_free(block);
+        block = next;
+    }
+
+    for (int class = 0; class < NUM_CACHE_CLASSES; class++) {
+        while (cache->bins[class] != NULL) {
+            block = cache->bins[class];
+            cache->bins[class] = block->next_cached;
+            heap_free(block);
+        }
+        cache->counts[class] = 0;
+    }
+}
+
+void *quick_malloc(thread_cache_ptr cache, int bin) {
+    s_block_ptr block = cache->quick[bin];
+    if (block == NULL) {
+        return NULL;
+    }
+    cache->quick[bin] = block->next_cached;
+    cache->quick_counts[bin]--;
+    cache->quick_blocks--;
+    __atomic_store_n(&cache->allocs[bin], cache->allocs[bin] + 1, __ATOMIC_RELAXED);
+    clear_link_words(block);
+    block->magic = BLOCK_MAGIC;
+    return block->data;
+}
+
+void quick_free(thread_cache_ptr cache, s_block_ptr block) {
+    /* The block stays used as far as the heap is concerned; only a stale
+     * ZEROED has to go */
+    size_t zeroed = scrub_block(block);
+    if ((LOAD_SIZE(block) & ZEROED) != zeroed) {
+        set_bits(block, ZEROED, zeroed);
+    }
+    int class = size_class(BLOCK_BYTES(block));
+    block->magic = QUICK_MAGIC;
+    block->next_cached = cache->quick[class];
+    cache->quick[class] = block;
+    cache->quick_blocks++;
+    if (++cache->quick_counts[class] <= QUICK_BIN_MAX) {
+        return;
+    }
+
+    /* Keep the newest half. Of the older half, blocks from this thread's
+     * cache go to its bins and the rest are merged back into the heap. */
+    s_block_ptr last = block;
+    for (int i = 1; i < QUICK_BIN_MAX / 2; i++) {
+        last = last->next_cached;
+    }
+    s_block_ptr spill = last->next_cached;
+    s_block_ptr heap_blocks = NULL;
+    last->next_cached = NULL;
+    cache->quick_blocks -= cache->quick_counts[class] - QUICK_BIN_MAX / 2;
+    cache->quick_counts[class] = QUICK_BIN_MAX / 2;
+    while (spill != NULL) {
+        s_block_ptr next = spill->next_cached;
+        if (spill->owner != 0) {
+            spill->magic = BLOCK_MAGIC;
+            set_bits(spill, STATE_MASK, BLOCK_CACHED);
+            cache_push(cache, spill);
+        } else {
+            spill->next_cached = heap_blocks;
+            heap_blocks = spill;
+        }
+        spill = next;
+    }
+    if (heap_blocks == NULL) {
+        return;
+    }
+    lock_heap();
+    while (heap_blocks != NULL) {
+        s_block_ptr next = heap_blocks->next_cached;
+        heap_free(heap_blocks);
+        heap_blocks = next;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void consolidate_quick(thread_cache_ptr cache) {
+    for (int class = 0; cache->quick_blocks != 0 && class < NUM_SMALL_CLASSES; class++) {
+        while (cache->quick[class] != NULL) {
+            s_block_ptr block = cache->quick[class];
+            cache->quick[class] = block->next_cached;
+            heap_free(block);
+        }
+        cache->quick_blocks -= cache->quick_counts[class];
+        cache->quick_counts[class] = 0;
+    }
+}
+
+
+#define SLAB_HEADER_SIZE ALIGN(sizeof(struct pool_slab))
+
+static void slab_push(pool_slab_ptr *list, pool_slab_ptr slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_unlink(pool_slab_ptr *list, pool_slab_ptr slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* Position of slab in the pool's slab index, or of the first slab above
+ * it if the pool has no such slab */
+static unsigned int slab_index_find(mm_pool_ptr pool, pool_slab_ptr slab) {
+    unsigned int low = 0;
+    unsigned int high = pool->slabs;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (pool->slab_index[mid] < slab) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int slab_index_add(mm_pool_ptr pool, pool_slab_ptr slab) {
+    if (pool->slabs == pool->slab_index_capacity) {
+        unsigned int capacity = pool->slab_index_capacity == 0 ? 16 : 2 * pool->slab_index_capacity;
+        pool_slab_ptr *index = mm_realloc(pool->slab_index, capacity * sizeof(pool_slab_ptr));
+        if (index == NULL) {
+            return 0;
+        }
+        pool->slab_index = index;
+        pool->slab_index_capacity = capacity;
+    }
+    unsigned int at = slab_index_find(pool, slab);
+    memmove(&pool->slab_index[at + 1], &pool->slab_index[at], (pool->slabs - at) * sizeof(pool_slab_ptr));
+    pool->slab_index[at] = slab;
+    pool->slabs++;
+    return 1;
+}
+
+static void slab_index_remove(mm_pool_ptr pool, pool_slab_ptr slab) {
+    unsigned int at = slab_index_find(pool, slab);
+    pool->slabs--;
+    memmove(&pool->slab_index[at], &pool->slab_index[at + 1], (pool->slabs - at) * sizeof(pool_slab_ptr));
+}
+
+static void release_slab_list(mm_pool_ptr pool, pool_slab_ptr slab) {
+    while (slab != NULL) {
+        pool_slab_ptr next = slab->next;
+        release_slab(pool, slab);
+        slab = next;
+    }
+}
+
+mm_pool_ptr mm_pool_create(size_t obj_size) {
+    if (obj_size == 0 || obj_size > SLAB_MAX_OBJECT) {
+        return NULL;
+    }
+    mm_pool_ptr pool = mm_malloc(sizeof(struct mm_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(struct mm_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->slot_size = ALIGN(obj_size);
+    pool->slots_per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / pool->slot_size;
+    return pool;
+}
+
+void *mm_pool_alloc(mm_pool_ptr pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool_slab_ptr slab = pool->partial;
+    if (slab == NULL) {
+        slab = pool->spare != NULL ? pool->spare : new_slab(pool);
+        pool->spare = NULL;
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        slab_push(&pool->partial, slab);
+    }
+
+    void *slot = slab->free_slots;
+    if (slot != NULL) {
+        slab->free_slots = *(void **) slot;
+    } else {
+        slot = slab->carve;
+        slab->carve += pool->slot_size;
+    }
+    if (++slab->used == pool->slots_per_slab) {
+        slab_unlink(&pool->partial, slab);
+        slab_push(&pool->full, slab);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+void mm_pool_free(mm_pool_ptr pool, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    /* Slabs are aligned to their size, so the slab header is found by
+     * masking. Pointers that are not in one of this pool's slabs, and
+     * ones off a slot boundary or never handed out, are ignored. */
+    pool_slab_ptr slab = (pool_slab_ptr) ((size_t) ptr & ~(size_t) (SLAB_SIZE - 1));
+    char *first = (char *) slab + SLAB_HEADER_SIZE;
+    if ((char *) ptr < first || ((char *) ptr - first) % pool->slot_size != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    unsigned int at = slab_index_find(pool, slab);
+    if (at == pool->slabs || pool->slab_index[at] != slab || (char *) ptr >= slab->carve) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    *(void **) ptr = slab->free_slots;
+    slab->free_slots = ptr;
+    if (slab->used-- == pool->slots_per_slab) {
+        slab_unlink(&pool->full, slab);
+        slab_push(&pool->partial, slab);
+    }
+
+    if (slab->used == 0) {
+        /* Keep one empty slab so a pool hovering at a slab boundary does
+         * not map and unmap on every call */
+        slab_unlink(&pool->partial, slab);
+        if (pool->spare == NULL) {
+            slab->free_slots = NULL;
+            slab->carve = first;
+            pool->spare = slab;
+        } else {
+            release_slab(pool, slab);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void mm_pool_destroy(mm_pool_ptr pool) {
+    if (pool == NULL) {
+        return;
+    }
+    release_slab_list(pool, pool->partial);
+    release_slab_list(pool, pool->full);
+    if (pool->spare != NULL) {
+        release_slab(pool, pool->spare);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    mm_free(pool->slab_index);
+    mm_free(pool);
+}
+
+pool_slab_ptr new_slab(mm_pool_ptr pool) {
+    /* Map twice the size and cut it down to an aligned slab */
+    char *map = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __atomic_fetch_add(&heap_stats.mmap_calls, 1, __ATOMIC_RELAXED);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    char *start = (char *) (((size_t) map + SLAB_SIZE - 1) & ~(size_t) (SLAB_SIZE - 1));
+    if (start > map) {
+        munmap(map, start - map);
+        __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+    }
+    munmap(start + SLAB_SIZE, map + SLAB_SIZE - start);
+    __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+
+    pool_slab_ptr slab = (pool_slab_ptr) start;
+    if (!slab_index_add(pool, slab)) {
+        munmap(start, SLAB_SIZE);
+        __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    slab->magic = SLAB_MAGIC;
+    slab->used = 0;
+    slab->pool = pool;
+    slab->free_slots = NULL;
+    slab->carve = start + SLAB_HEADER_SIZE;
+    return slab;
+}
+
+void release_slab(mm_pool_ptr pool, pool_slab_ptr slab) {
+    slab_index_remove(pool, slab);
+    slab->magic = 0;
+    munmap(slab, SLAB_SIZE);
+    __atomic_fetch_add(&heap_stats.munmap_calls, 1, __ATOMIC_RELAXED);
+}
+
+
+mm_arena_ptr mm_arena_create(void *buffer, size_t size) {
+    int owns_buffer = buffer == NULL;
+    if (owns_buffer) {
+        size = size > sizeof(struct mm_arena) ? size : ARENA_DEFAULT_SIZE;
+        buffer = mm_malloc(size);
+        if (buffer == NULL) {
+            return NULL;
+        }
+    }
+
+    /* The arena goes at the first aligned address in the buffer and the
+     * rest of the buffer is its first chunk */
+    char *start = (char *) ALIGN((size_t) buffer);
+    if (size < (size_t) (start - (char *) buffer) + sizeof(struct mm_arena)) {
+        return NULL;
+    }
+    mm_arena_ptr arena = (mm_arena_ptr) start;
+    arena->size = size - (start - (char *) buffer) - sizeof(struct mm_arena);
+    arena->ptr = arena->data;
+    arena->end = arena->data + arena->size;
+    arena->chunks = NULL;
+    arena->spare = NULL;
+    arena->next_chunk = arena->size < ARENA_DEFAULT_SIZE ? ARENA_DEFAULT_SIZE : arena->size;
+    arena->owns_buffer = owns_buffer;
+    return arena;
+}
+
+void *mm_arena_alloc(mm_arena_ptr arena, size_t size) {
+    /* No chunk holds more, and past SIZE_MAX - ALIGNMENT + 1 the size
+     * would align down to nothing */
+    if (size > PTRDIFF_MAX - sizeof(struct arena_chunk)) {
+        return NULL;
+    }
+    size = ALIGN(size);
+    if (size <= (size_t) (arena->end - arena->ptr)) {
+        void *ptr = arena->ptr;
+        arena->ptr += size;
+        return ptr;
+    }
+    return arena_grow(arena, size);
+}
+
+void mm_arena_reset(mm_arena_ptr arena) {
+    /* Everything goes back except the newest chunk, the biggest so far,
+     * which is kept for the next time the first chunk runs out */
+    arena_chunk_ptr chunk = arena->chunks;
+    if (chunk != NULL) {
+        mm_free(arena->spare);
+        arena->spare = chunk;
+        chunk = chunk->next;
+    }
+    while (chunk != NULL) {
+        arena_chunk_ptr next = chunk->next;
+        mm_free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->ptr = arena->data;
+    arena->end = arena->data + arena->size;
+}
+
+void mm_arena_destroy(mm_arena_ptr arena) {
+    if (arena == NULL) {
+        return;
+    }
+    mm_arena_reset(arena);
+    mm_free(arena->spare);
+    if (arena->owns_buffer) {
+        mm_free(arena);
+    }
+}
+
+void *arena_grow(mm_arena_ptr arena, size_t size) {
+    if (size > PTRDIFF_MAX - sizeof(struct arena_chunk)) {
+        return NULL;
+    }
+
+    arena_chunk_ptr chunk = arena->spare;
+    if (chunk != NULL && chunk->size >= size) {
+        arena->spare = NULL;
+    } else {
+        size_t chunk_size = arena->next_chunk > size ? arena->next_chunk : size;
+        chunk = mm_malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        if (arena->next_chunk < ARENA_MAX_CHUNK) {
+            arena->next_chunk *= 2;
+        }
+    }
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->ptr = chunk->data + size;
+    arena->end = chunk->data + chunk->size;
+    return chunk->data;
+}
+
+
+/* Shared-memory heap. Blocks run from shm->data to an end marker, a used
+ * header of size 0, and carry the same state bits and PREV_FREE as heap
+ * blocks, with a footer in free blocks. Everything happens under the
+ * lock; only offsets are stored, never pointers. */
+#define SHM_AT(shm, offset) ((shm_block_ptr) ((char *) (shm) + (offset)))
+#define SHM_OFFSET(shm, b) ((size_t) ((char *) (b) - (char *) (shm)))
+#define SHM_BYTES(b) ((b)->size & ~(size_t) FLAG_MASK)
+
+static void shm_insert(mm_shm_ptr shm, shm_block_ptr b) {
+    int class = size_class(SHM_BYTES(b));
+    b->prev_free = 0;
+    b->next_free = shm->free_lists[class];
+    if (b->next_free != 0) {
+        SHM_AT(shm, b->next_free)->prev_free = SHM_OFFSET(shm, b);
+    }
+    shm->free_lists[class] = SHM_OFFSET(shm, b);
+    shm->free_map[class / 64] |= 1ULL << (class % 64);
+}
+
+static void shm_remove(mm_shm_ptr shm, shm_block_ptr b) {
+    int class = size_class(SHM_BYTES(b));
+    if (b->prev_free != 0) {
+        SHM_AT(shm, b->prev_free)->next_free = b->next_free;
+    } else {
+        shm->free_lists[class] = b->next_free;
+    }
+    if (b->next_free != 0) {
+        SHM_AT(shm, b->next_free)->prev_free = b->prev_free;
+    }
+    if (shm->free_lists[class] == 0) {
+        shm->free_map[class / 64] &= ~(1ULL << (class % 64));
+    }
+}
+
+/* Turn b into a free block of the given size and tell the next block */
+static void shm_make_free(mm_shm_ptr shm, shm_block_ptr b, size_t bytes) {
+    b->size = bytes | BLOCK_FREE | (b->size & PREV_FREE);
+    *(size_t *) ((char *) b + bytes - sizeof(size_t)) = bytes;
+    SHM_AT(b, bytes)->size |= PREV_FREE;
+    shm_insert(shm, b);
+}
+
+/* First fit among a few blocks of the request's own class, else the first
+ * block of the next class up that has any, all of which fit */
+static shm_block_ptr shm_find(mm_shm_ptr shm, size_t bytes) {
+    int class = size_class(bytes);
+    size_t at = shm->free_lists[class];
+    for (int scanned = 0; at != 0 && scanned < RANGE_SCAN_LIMIT; scanned++) {
+        if (SHM_BYTES(SHM_AT(shm, at)) >= bytes) {
+            return SHM_AT(shm, at);
+        }
+        at = SHM_AT(shm, at)->next_free;
+    }
+    for (int next = class + 1; next < NUM_SIZE_CLASSES; next = (next / 64 + 1) * 64) {
+        unsigned long long bits = shm->free_map[next / 64] >> (next % 64);
+        if (bits != 0) {
+            return SHM_AT(shm, shm->free_lists[next + __builtin_ctzll(bits)]);
+        }
+    }
+    return NULL;
+}
+
+/* The block behind ptr, if ptr is a live block of this heap */
+static shm_block_ptr shm_block(mm_shm_ptr shm, void *ptr) {
+    char *c = ptr;
+    if (c < shm->data + BLOCK_SIZE || c >= (char *) shm + shm->size || ((size_t) c & (ALIGNMENT - 1)) != 0) {
+        return NULL;
+    }
+    shm_block_ptr b = (shm_block_ptr) (c - BLOCK_SIZE);
+    if (b->magic != BLOCK_MAGIC || (b->size & STATE_MASK) != BLOCK_USED || SHM_BYTES(b) == 0) {
+        return NULL;
+    }
+    return b;
+}
+
+static int lock_shm(mm_shm_ptr shm) {
+    int error = pthread_mutex_lock(&shm->lock);
+    if (error == EOWNERDEAD) {
+        /* A process died holding the lock, maybe halfway through relinking
+         * a block. Carrying on with the heap as it is beats leaving every
+         * other process stuck. */
+        pthread_mutex_consistent(&shm->lock);
+        error = 0;
+    }
+    return error;
+}
+
+mm_shm_ptr mm_shm_create(void *region, size_t size) {
+    /* The heap goes at the first aligned address in the region, followed
+     * by one free block and the end marker */
+    char *start = (char *) ALIGN((size_t) region);
+    size_t overhead = (start - (char *) region) + sizeof(struct mm_shm) + BLOCK_SIZE;
+    if (region == NULL || size < overhead + MIN_BLOCK_SIZE) {
+        return NULL;
+    }
+    mm_shm_ptr shm = (mm_shm_ptr) start;
+    memset(shm, 0, sizeof(struct mm_shm));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int error = pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (error != 0) {
+        return NULL;
+    }
+
+    size_t bytes = (size - overhead) & ~(size_t) (ALIGNMENT - 1);
+    shm_block_ptr end = (shm_block_ptr) (shm->data + bytes);
+    end->size = BLOCK_USED;
+    end->magic = BLOCK_MAGIC;
+    shm_block_ptr first = (shm_block_ptr) shm->data;
+    first->size = 0;
+    shm_make_free(shm, first, bytes);
+    shm->size = SHM_OFFSET(shm, end) + BLOCK_SIZE;
+
+    /* Processes that attach look at the magic first */
+    __atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+mm_shm_ptr mm_shm_attach(void *region) {
+    if (region == NULL) {
+        return NULL;
+    }
+    mm_shm_ptr shm = (mm_shm_ptr) ALIGN((size_t) region);
+    return __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC ? shm : NULL;
+}
+
+void *mm_shm_alloc(mm_shm_ptr shm, size_t size) {
+    size_t bytes = block_size_for(size);
+    if (size == 0 || bytes == 0 || lock_shm(shm) != 0) {
+        return NULL;
+    }
+    shm_block_ptr b = shm_find(shm, bytes);
+    if (b == NULL) {
+        pthread_mutex_unlock(&shm->lock);
+        return NULL;
+    }
+    shm_remove(shm, b);
+
+    size_t total = SHM_BYTES(b);
+    if (total >= bytes + MIN_BLOCK_SIZE) {
+        shm_block_ptr rest = SHM_AT(b, bytes);
+        rest->size = 0;
+        shm_make_free(shm, rest, total - bytes);
+        total = bytes;
+    } else {
+        SHM_AT(b, total)->size &= ~(size_t) PREV_FREE;
+    }
+    b->size = total | BLOCK_USED;
+    b->magic = BLOCK_MAGIC;
+    shm->in_use += total;
+    pthread_mutex_unlock(&shm->lock);
+    return (char *) b + BLOCK_SIZE;
+}
+
+void mm_shm_free(mm_shm_ptr shm, void *ptr) {
+    if (ptr == NULL || lock_shm(shm) != 0) {
+        return;
+    }
+    shm_block_ptr b = shm_block(shm, ptr);
+    if (b == NULL) {
+        pthread_mutex_unlock(&shm->lock);
+        return;
+    }
+    size_t bytes = SHM_BYTES(b);
+    shm->in_use -= bytes;
+    b->magic = 0;
+
+    if (b->size & PREV_FREE) {
+        size_t prev_bytes = *(size_t *) ((char *) b - sizeof(size_t));
+        b = SHM_AT(b, -prev_bytes);
+        shm_remove(shm, b);
+        bytes += prev_bytes;
+    }
+    shm_block_ptr next = SHM_AT(b, bytes);
+    if ((next->size & STATE_MASK) == BLOCK_FREE) {
+        shm_remove(shm, next);
+        bytes += SHM_BYTES(next);
+    }
+    shm_make_free(shm, b, bytes);
+    pthread_mutex_unlock(&shm->lock);
+}
+
+size_t mm_shm_offset(mm_shm_ptr shm, void *ptr) {
+    return ptr == NULL ? 0 : SHM_OFFSET(shm, ptr);
+}
+
+void *mm_shm_pointer(mm_shm_ptr shm, size_t offset) {
+    return offset == 0 ? NULL : (char *) shm + offset;
+}
+
+void mm_shm_destroy(mm_shm_ptr shm) {
+    shm->magic = 0;
+    pthread_mutex_destroy(&shm->lock);
+}
+
+/* AnonHugePages of the mappings that start in [low, high), from
+ * /proc/self/smaps. Read with plain read(2) into a stack buffer so it
+ * neither allocates nor minds being called from a signal handler. */
+static size_t huge_page_bytes(char *low, char *high) {
+    int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    char buf[4096];
+    size_t have = 0, total = 0;
+    int in_range = 0;
+    ssize_t got;
+    while ((got = read(fd, buf + have, sizeof(buf) - 1 - have)) > 0) {
+        have += got;
+        buf[have] = '\0';
+        char *line = buf, *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            unsigned long start, end, kb;
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+                in_range = (char *) start >= low && (char *) start < high;
+            } else if (in_range && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+                total += kb * 1024;
+            }
+            line = newline + 1;
+        }
+        have -= line - buf;
+        memmove(buf, line, have);
+    }
+    close(fd);
+    return total;
+}
+
+size_t mm_trim(void) {
+    lock_heap();
+    if (my_cache != NULL) {
+        consolidate_quick(my_cache);
+    }
+    size_t released = 0;
+    for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+        for (s_block_ptr b = free_lists[class]; b != NULL; b = b->next_free) {
+            released += purge_block(b);
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return released;
+}
+
+/* Fills in stats for mm_stats. Unless wait is set, nothing blocks: if the
+ * heap lock is held this returns -1, and if the profile lock is, the
+ * profile counts are left at 0 and 0 is returned rather than 1. */
+static int collect_stats(struct mm_stats *stats, int wait) {
+    if (wait) {
+        lock_heap();
+    } else if (pthread_mutex_trylock(&heap_lock) == 0) {
+        heap_stats.heap_locks++;
+    } else {
+        return -1;
+    }
+    *stats = heap_stats;
+    for (unsigned int i = 0; i < cache_count; i++) {
+        for (int class = 0; class < NUM_SMALL_CLASSES; class++) {
+            stats->size_classes[class] += __atomic_load_n(&cache_table[i]->allocs[class], __ATOMIC_RELAXED);
+        }
+    }
+
+    /* The largest free block is in the highest non-empty class */
+    stats->largest_free = 0;
+    for (int class = NUM_SIZE_CLASSES - 1; class >= 0 && stats->largest_free == 0; class--) {
+        for (s_block_ptr b = free_lists[class]; b != NULL; b = b->next_free) {
+            if (BLOCK_BYTES(b) > stats->largest_free) {
+                stats->largest_free = BLOCK_BYTES(b);
+            }
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    /* Counted in whole huge pages, so the top one may reach past the break */
+    stats->huge_bytes = huge_pages > 0 ? huge_page_bytes(huge_base, huge_limit) : 0;
+    if (stats->huge_bytes > stats->heap_bytes) {
+        stats->huge_bytes = stats->heap_bytes;
+    }
+    int profiled = 1;
+    if (wait) {
+        pthread_mutex_lock(&profile_lock);
+    } else if (pthread_mutex_trylock(&profile_lock) != 0) {
+        profiled = 0;
+    }
+    if (profiled) {
+        stats->profile_samples = profile_live;
+        stats->profile_dropped = profile_dropped;
+        pthread_mutex_unlock(&profile_lock);
+    } else {
+        stats->profile_samples = stats->profile_dropped = 0;
+    }
+    stats->in_use_bytes = stats->heap_bytes - stats->free_bytes;
+    stats->fragmentation = stats->free_bytes == 0 ? 0 : 1 - (double) stats->largest_free / stats->free_bytes;
+    stats->mapped_allocations = __atomic_load_n(&heap_stats.mapped_allocations, __ATOMIC_RELAXED);
+    stats->heap_lock_waits = __atomic_load_n(&heap_stats.heap_lock_waits, __ATOMIC_RELAXED);
+    stats->allocations = stats->mapped_allocations;
+    for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+        stats->allocations += stats->size_classes[class];
+    }
+    return profiled;
+}
+
+void mm_stats(struct mm_stats *stats) {
+    collect_stats(stats, 1);
+}
+
+/* Largest block size in a class, for labelling the dump */
+static size_t class_limit(int class) {
+    if (class < NUM_SMALL_CLASSES) {
+        return (size_t) (class + 2) * ALIGNMENT;
+    }
+    return ((size_t) SMALL_LIMIT << (class - NUM_SMALL_CLASSES + 1)) - 1;
+}
+
+void mm_stats_dump(int fd) {
+    /* Formatted on the stack and written with write(2), so this works
+     * without stdio buffers from a signal handler or at exit. A signal
+     * that lands while the heap lock is held gets no report, and one that
+     * lands while the profile lock is held gets none of the profile,
+     * rather than a deadlock. */
+    struct mm_stats stats;
+    int profiled = collect_stats(&stats, 0);
+    if (profiled < 0) {
+        static const char busy[] = "mm_stats: heap busy, try again\n";
+        write(fd, busy, sizeof(busy) - 1);
+        return;
+    }
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf),
+                       "mm_stats: heap %zu bytes, in use %zu, free %zu, largest free %zu, "
+                       "fragmentation %.3f\n"
+                       "mm_stats: mapped %zu bytes in %lu allocations, %lu allocations in all, "
+                       "%lu coalesces\n"
+                       "mm_stats: syscalls sbrk %lu, mmap %lu, munmap %lu, mremap %lu, madvise %lu "
+                       "(%zu bytes purged)\n"
+                       "mm_stats: heap lock taken %lu times, %lu of them after waiting\n"
+                       "mm_stats: search length:",
+                       stats.heap_bytes, stats.in_use_bytes, stats.free_bytes, stats.largest_free,
+                       stats.fragmentation, stats.mapped_bytes, stats.mapped_allocations,
+                       stats.allocations, stats.coalesces, stats.sbrk_calls, stats.mmap_calls,
+                       stats.munmap_calls, stats.mremap_calls, stats.madvise_calls, stats.purged_bytes,
+                       stats.heap_locks, stats.heap_lock_waits);
+    for (int i = 0; i < MM_SEARCH_BUCKETS; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, " %d:%lu", i, stats.search_lengths[i]);
+    }
+    if (huge_pages > 0) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\nmm_stats: huge pages back %zu of %zu heap bytes",
+                        stats.huge_bytes, stats.heap_bytes);
+    }
+    if (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0) {
+        len += profiled ? snprintf(buf + len, sizeof(buf) - len, "\nmm_stats: profile %lu live samples, %lu dropped",
+                                   stats.profile_samples, stats.profile_dropped)
+                        : snprintf(buf + len, sizeof(buf) - len, "\nmm_stats: profile busy");
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "\nmm_stats: size classes, block bytes up to:\n");
+    write(fd, buf, len);
+
+    for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+        if (stats.size_classes[class] != 0) {
+            len = snprintf(buf, sizeof(buf), "  %10zu %10lu\n", class_limit(class), stats.size_classes[class]);
+            write(fd, buf, len);
+        }
+    }
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written <= 0) {
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+#define FRAME_NAME_MAX 128
+
+/* Name a frame for a folded stack: its symbol if the dynamic linker knows
+ * one, else its offset in the object it belongs to. Never more than
+ * FRAME_NAME_MAX characters. */
+static int frame_name(char *buf, size_t size, void *frame) {
+    Dl_info info;
+    if (dladdr(frame, &info) == 0) {
+        return snprintf(buf, size, "0x%lx", (unsigned long) frame);
+    }
+    if (info.dli_sname != NULL) {
+        return snprintf(buf, size, "%.100s", info.dli_sname);
+    }
+    const char *name = strrchr(info.dli_fname, '/');
+    return snprintf(buf, size, "%.100s+0x%lx", name != NULL ? name + 1 : info.dli_fname,
+                    (unsigned long) ((char *) frame - (char *) info.dli_fbase));
+}
+
+static void dump_pprof(int fd, profile_sample_ptr samples, unsigned long count, size_t rate) {
+    char buf[1024];
+    size_t bytes = 0;
+    for (unsigned long i = 0; i < count; i++) {
+        bytes += samples[i].size;
+    }
+    /* Sampled counts and sizes as they are; heap_v2 tells pprof the rate
+     * so it can scale them up itself */
+    int len = snprintf(buf, sizeof(buf), "heap profile: %lu: %zu [%lu: %zu] @ heap_v2/%zu\n", count, bytes,
+                       count, bytes, rate);
+    write_all(fd, buf, len);
+    for (unsigned long i = 0; i < count; i++) {
+        len = snprintf(buf, sizeof(buf), "1: %zu [1: %zu] @", samples[i].size, samples[i].size);
+        for (int f = 0; f < samples[i].depth; f++) {
+            len += snprintf(buf + len, sizeof(buf) - len, " 0x%lx", (unsigned long) samples[i].frames[f]);
+        }
+        buf[len++] = '\n';
+        write_all(fd, buf, len);
+    }
+
+    /* pprof maps the addresses back to code with the process's mappings */
+    write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t got;
+        while ((got = read(maps, buf, sizeof(buf))) > 0) {
+            write_all(fd, buf, got);
+        }
+        close(maps);
+    }
+}
+
+static void dump_folded(int fd, profile_sample_ptr samples, unsigned long count, size_t rate) {
+    char buf[PROFILE_MAX_DEPTH * (FRAME_NAME_MAX + 1) + 32];
+    for (unsigned long i = 0; i < count; i++) {
+        /* Outermost frame first, as flame graph tools expect */
+        int len = 0;
+        for (int f = samples[i].depth - 1; f >= 0; f--) {
+            len += frame_name(buf + len, FRAME_NAME_MAX, samples[i].frames[f]);
+            buf[len++] = f > 0 ? ';' : ' ';
+        }
+        double size = samples[i].size;
+        double estimate = size / (1 - exp(-size / rate));
+        len += snprintf(buf + len, sizeof(buf) - len, "%.0f\n", estimate);
+        write_all(fd, buf, len);
+    }
+}
+
+int mm_profile_dump(int fd, int format) {
+    if (format != MM_PROFILE_PPROF && format != MM_PROFILE_FOLDED) {
+        return -1;
+    }
+    /* Copy the samples out so that neither the symbol lookups nor a slow
+     * fd hold up allocating threads */
+    pthread_mutex_lock(&profile_lock);
+    size_t bytes = (profile_live + 1) * sizeof(struct profile_sample);
+    profile_sample_ptr copy = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) {
+        pthread_mutex_unlock(&profile_lock);
+        return -1;
+    }
+    unsigned long count = 0;
+    for (int bucket = 0; bucket < (1 << PROFILE_BUCKET_BITS); bucket++) {
+        for (profile_sample_ptr sample = profile_buckets[bucket]; sample != NULL; sample = sample->next) {
+            copy[count++] = *sample;
+        }
+    }
+    size_t rate = profile_rate;
+    pthread_mutex_unlock(&profile_lock);
+
+    if (format == MM_PROFILE_PPROF) {
+        dump_pprof(fd, copy, count, rate);
+    } else {
+        dump_folded(fd, copy, count, rate);
+    }
+    munmap(copy, bytes);
+    return 0;
 }
@@ -3,35 +3,325 @@
 #ifndef _malloc_H_
 #define _malloc_H_
 
-/* Define the block size since the sizeof will be wrong */
-#define BLOCK_SIZE 40
+/* Bytes in front of every payload: the size word plus the tag and owner */
+#define BLOCK_SIZE 16
+
+/* Blocks and payloads are aligned to this; block sizes are multiples of it */
+#define ALIGNMENT 16
+
+/* Smallest block: header, two free-list links and the footer of a free block */
+#define MIN_BLOCK_SIZE 32
+
+/* Free lists: exact classes of ALIGNMENT bytes for blocks up to SMALL_LIMIT,
+ * then one class per power of two */
+#define SMALL_LIMIT 1024
+#define NUM_SMALL_CLASSES (SMALL_LIMIT / ALIGNMENT - 1)
+#define NUM_SIZE_CLASSES 128
+
+/* How many blocks of the request's own range class are tried before moving on */
+#define RANGE_SCAN_LIMIT 8
+
+/* mm_stats search lengths: blocks looked at per free list search, 0 when
+ * nothing fit and the heap had to grow */
+#define MM_SEARCH_BUCKETS (RANGE_SCAN_LIMIT + 2)
+
+/* Tag stored in every live header so get_block can reject foreign pointers */
+#define BLOCK_MAGIC 0x162a110cU
+
+/* Block states, kept in the low bits of s_block.size; cached blocks sit in a
+ * thread cache and look allocated to the shared heap */
+#define BLOCK_USED 0
+#define BLOCK_FREE 1
+#define BLOCK_CACHED 2
+#define BLOCK_MAPPED 3
+#define STATE_MASK 0x3
+
+/* The block before this one is free, so the word before the header is its
+ * footer */
+#define PREV_FREE 0x4
+
+/* The payload is known to be zero apart from the allocator's own link and
+ * footer words */
+#define ZEROED 0x8
+
+#define FLAG_MASK (ALIGNMENT - 1)
+
+/* Per-thread caches hold blocks with payloads up to CACHE_LIMIT bytes */
+#define CACHE_LIMIT 256
+#define NUM_CACHE_CLASSES ((CACHE_LIMIT + BLOCK_SIZE) / ALIGNMENT - 1)
+#define CACHE_BIN_MAX 64
+#define CACHE_REFILL 16
+#define MAX_THREAD_CACHES 1024
+
+/* Freed blocks up to SMALL_LIMIT bytes wait in a per-thread quick bin, up
+ * to QUICK_BIN_MAX a size, before they are merged with their neighbours */
+#define QUICK_BIN_MAX 8
+#define QUICK_MAGIC 0x9b1c4a7eU
+
+/* Parameters for mm_config */
+#define MM_MMAP_THRESHOLD 1
+#define MM_HEAP_CHUNK 2
+#define MM_TRIM_THRESHOLD 3
+/* Write mm_stats to the given fd at exit, or when the given signal arrives */
+#define MM_STATS_AT_EXIT 4
+#define MM_STATS_SIGNAL 5
+/* Non-zero: keep the heap in a huge page backed mapping instead of the sbrk
+ * area. Only before the first allocation; MM_HUGE_PAGES=1 in the
+ * environment does the same. */
+#define MM_HUGE_PAGES 6
+/* Heap profiling: sample about one allocation per this many bytes, 0 to
+ * stop; see mm_profile_dump */
+#define MM_PROFILE_INTERVAL 7
+
+/* mm_profile_dump formats: a pprof heap profile, or one line of folded
+ * frames and estimated bytes per live sample, for flame graphs */
+#define MM_PROFILE_PPROF 0
+#define MM_PROFILE_FOLDED 1
+
+/* Profiling samples allocations a mean of this many bytes apart. Up to
+ * PROFILE_MAX_SAMPLES live samples are kept, with the innermost
+ * PROFILE_MAX_DEPTH frames of each backtrace. While profiling is off each
+ * thread only looks again every PROFILE_RECHECK bytes. */
+#define DEFAULT_PROFILE_INTERVAL (512 * 1024)
+#define PROFILE_MAX_SAMPLES 65536
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BUCKET_BITS 14
+#define PROFILE_RECHECK (1024 * 1024)
+
+/* Payloads of at least this many bytes get their own mapping by default */
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+/* The heap grows by at least a chunk at a time, and a free top block
+ * larger than the trim threshold is cut back to one chunk. Free blocks
+ * elsewhere that reach the trim threshold have their pages purged. */
+#define DEFAULT_HEAP_CHUNK (128 * 1024)
+#define DEFAULT_TRIM_THRESHOLD (512 * 1024)
+
+/* In huge page mode the heap gets this much address space up front,
+ * aligned to a huge page and made usable a huge page at a time */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_HEAP_RESERVE ((size_t) 64 << 30)
+
+/* Pools carve slabs of SLAB_SIZE bytes, aligned to their size, into equal
+ * slots; objects larger than SLAB_MAX_OBJECT go to mm_malloc instead */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX_OBJECT (SLAB_SIZE / 8)
+#define SLAB_MAGIC 0x51ab51abU
+
+/* Tag at the start of a shared-memory heap, checked by mm_shm_attach */
+#define SHM_MAGIC 0x5a4ed0e1U
+
+/* Arenas made without a buffer start with this much space, and each chunk
+ * chained on after it is twice the last, up to ARENA_MAX_CHUNK */
+#define ARENA_DEFAULT_SIZE (8 * 1024)
+#define ARENA_MAX_CHUNK (1024 * 1024)
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#include <pthread.h>
 #include <stdlib.h>
 
 typedef struct s_block *s_block_ptr;
 
-/* block struct */
+typedef struct thread_cache *thread_cache_ptr;
+
+/* Small blocks a thread can hand out without taking the heap lock. Other
+ * threads give blocks back through remote_frees, which only the owner
+ * drains. */
+struct thread_cache {
+    s_block_ptr bins[NUM_CACHE_CLASSES];
+    int counts[NUM_CACHE_CLASSES];
+    s_block_ptr remote_frees;
+    struct thread_cache *next_orphan;
+    unsigned int id;
+    /* Blocks freed by this thread and not yet merged back. They keep their
+     * used state, so a malloc of the same size takes one straight back
+     * without touching the size word or the heap lock. */
+    s_block_ptr quick[NUM_SMALL_CLASSES];
+    int quick_counts[NUM_SMALL_CLASSES];
+    unsigned int quick_blocks;
+    /* Allocations served by this cache, for mm_stats */
+    unsigned long allocs[NUM_SMALL_CLASSES];
+};
+
+/* block struct: the size of the whole block with the state and flags in its
+ * low bits. Neighbours are found by address: the next block starts size
+ * bytes on, and a free block repeats its size in a footer so the block
+ * after it can find it. */
 struct s_block {
     size_t size;
-    struct s_block *next;
-    struct s_block *prev;
-    int is_free;
+    union {
+        /* Live blocks: tag and the thread cache (id + 1) the block goes
+         * back to, 0 for shared heap blocks. Mapped blocks keep the
+         * distance from the start of their mapping to the header here. */
+        struct {
+            unsigned int magic;
+            unsigned int owner;
+        };
+        /* Free blocks: links in the size-class free list */
+        struct s_block *next_free;
+    };
+    union {
+        struct s_block *prev_free;
+        /* Cached blocks: next block in a bin or remote free list */
+        struct s_block *next_cached;
+        /* A pointer to the allocated block */
+        char data[0];
+    };
+};
+
+typedef struct pool_slab *pool_slab_ptr;
+
+typedef struct mm_pool *mm_pool_ptr;
+
+/* slab struct: sits at the start of its slab, followed by the slots. Slots
+ * past the carve mark have never been handed out and are not on the free
+ * list, so a new slab costs nothing until it is used. */
+struct pool_slab {
+    unsigned int magic;
+    unsigned int used;
+    mm_pool_ptr pool;
+    void *free_slots;
+    char *carve;
+    /* Neighbours in the pool's partial or full slab list */
+    struct pool_slab *prev;
+    struct pool_slab *next;
+};
+
+/* Fixed-size object pool. Slabs with free slots are kept on the partial
+ * list, so mm_pool_alloc never searches; one empty slab is kept as a spare
+ * and any further ones go back to the OS. Every slab is also in slab_index,
+ * sorted by address, so mm_pool_free can tell a pointer is the pool's
+ * before it reads anything through it. */
+struct mm_pool {
+    pthread_mutex_t lock;
+    size_t slot_size;
+    unsigned int slots_per_slab;
+    unsigned int slabs;
+    unsigned int slab_index_capacity;
+    pool_slab_ptr *slab_index;
+    pool_slab_ptr partial;
+    pool_slab_ptr full;
+    pool_slab_ptr spare;
+};
+
+typedef struct shm_block *shm_block_ptr;
+
+typedef struct mm_shm *mm_shm_ptr;
+
+/* Block in a shared-memory heap. Same layout and flags as a heap block,
+ * but free list links are offsets from the start of the heap, 0 for none,
+ * so that they mean the same in every process that maps it. */
+struct shm_block {
+    size_t size;
+    union {
+        size_t magic;
+        size_t next_free;
+    };
+    size_t prev_free;
+};
+
+/* Heap in a MAP_SHARED region supplied by the caller, which processes may
+ * map at different addresses. It holds no pointers; blocks are handed
+ * between processes as offsets (see mm_shm_offset and mm_shm_pointer),
+ * and root is left for the caller to record where its own shared data
+ * starts. The lock is process-shared and robust. */
+struct mm_shm {
+    unsigned int magic;
+    size_t size;
+    size_t in_use;
+    size_t root;
+    pthread_mutex_t lock;
+    size_t free_lists[NUM_SIZE_CLASSES];
+    unsigned long long free_map[NUM_SIZE_CLASSES / 64];
+    char data[0] __attribute__((aligned(16)));
+};
+
+typedef struct profile_sample *profile_sample_ptr;
+
+/* A sampled allocation, in its hash bucket by address while it is live or
+ * on the free list of sample slots */
+struct profile_sample {
+    struct profile_sample *next;
     void *ptr;
-    /* A pointer to the allocated block */
-    char data[0];
+    size_t size;
+    int depth;
+    void *frames[PROFILE_MAX_DEPTH];
+};
+
+typedef struct arena_chunk *arena_chunk_ptr;
+
+typedef struct mm_arena *mm_arena_ptr;
+
+/* Extra space chained on once an arena's first chunk is full */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    char data[0] __attribute__((aligned(16)));
+};
+
+/* Bump allocator for memory that dies all at once. The arena sits at the
+ * start of its first chunk, which is either a buffer from the caller (say
+ * on the stack) or a block from mm_malloc. Not thread-safe. */
+struct mm_arena {
+    char *ptr;
+    char *end;
+    /* Chained chunks, newest first; reset keeps the newest as spare */
+    arena_chunk_ptr chunks;
+    arena_chunk_ptr spare;
+    size_t next_chunk;
+    size_t size;
+    int owns_buffer;
+    char data[0] __attribute__((aligned(16)));
+};
+
+/* Snapshot filled in by mm_stats. Heap bytes include headers and blocks
+ * parked in thread caches, which the heap counts as in use. */
+struct mm_stats {
+    size_t heap_bytes;
+    size_t in_use_bytes;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t mapped_bytes;
+    /* Heap bytes the kernel has backed with huge pages, in huge page mode */
+    size_t huge_bytes;
+    /* 1 - largest_free / free_bytes: how much of the free space a single
+     * large request cannot use */
+    double fragmentation;
+    unsigned long allocations;
+    unsigned long mapped_allocations;
+    unsigned long coalesces;
+    unsigned long search_lengths[MM_SEARCH_BUCKETS];
+    /* Allocations from the heap by the size class of their block */
+    unsigned long size_classes[NUM_SIZE_CLASSES];
+    unsigned long sbrk_calls;
+    unsigned long mmap_calls;
+    unsigned long munmap_calls;
+    unsigned long mremap_calls;
+    /* Pages of free blocks handed back with madvise, by mm_trim or once a
+     * free block reaches the trim threshold */
+    unsigned long madvise_calls;
+    size_t purged_bytes;
+    /* Times the heap lock was taken, and how many of those had to wait
+     * for another thread */
+    unsigned long heap_locks;
+    unsigned long heap_lock_waits;
+    /* Heap profile samples still live, and those lost to a full table */
+    unsigned long profile_samples;
+    unsigned long profile_dropped;
 };
 
 // Helper functions
 void *allocate_block(s_block_ptr block, size_t size);
 
-void *allocate_new_block(size_t size, s_block_ptr last_block);
+void *allocate_new_block(size_t size);
 
 void *realloc_existing_block(void *ptr, size_t size, s_block_ptr block);
 
+int realloc_in_place(s_block_ptr block, size_t size);
+
 // Main functions
 void *mm_malloc(size_t size);
 
@@ -39,26 +329,144 @@ void *mm_realloc(void *ptr, size_t size);
 
 void mm_free(void *ptr);
 
-// Block management functions
-s_block_ptr create_block(void *ptr, size_t size);
+void *mm_calloc(size_t count, size_t size);
+
+void *mm_memalign(size_t alignment, size_t size);
 
-void insert_block_after(s_block_ptr prev_block, s_block_ptr new_block);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+void mm_free_batch(void **ptrs, size_t n);
+
+size_t mm_usable_size(void *ptr);
+
+int mm_config(int param, size_t value);
+
+void mm_stats(struct mm_stats *stats);
+
+void mm_stats_dump(int fd);
+
+size_t mm_trim(void);
+
+int mm_profile_dump(int fd, int format);
+
+// Block management functions
+s_block_ptr create_block(void *ptr, size_t size, int state);
 
 void update_block(s_block_ptr block, size_t size);
 
-void initialize_block(s_block_ptr block, s_block_ptr prev_block, size_t size);
+s_block_ptr next_block(s_block_ptr b);
+
+s_block_ptr prev_block(s_block_ptr b);
 
-void try_fusion_with_previous(s_block_ptr b);
+s_block_ptr try_fusion_with_previous(s_block_ptr b);
 
-void try_fusion_with_next(s_block_ptr b);
+s_block_ptr try_fusion_with_next(s_block_ptr b);
 
 void split_block(s_block_ptr b, size_t s);
 
-void *extend_heap(s_block_ptr last, size_t s);
+void shrink_block(s_block_ptr b, size_t s);
+
+char *grow_break(size_t grow);
+
+void *extend_heap(size_t s);
+
+void trim_heap(void);
+
+size_t purge_block(s_block_ptr b);
 
 s_block_ptr get_block(void *p);
 
-void fusion(s_block_ptr b);
+s_block_ptr fusion(s_block_ptr b);
+
+// Free list management functions
+int size_class(size_t size);
+
+void insert_free_block(s_block_ptr b);
+
+void remove_free_block(s_block_ptr b);
+
+s_block_ptr find_free_block(size_t size);
+
+// Shared heap functions, called with the heap lock held
+void *heap_malloc(size_t size);
+
+void heap_free(s_block_ptr block);
+
+void *heap_memalign(size_t alignment, size_t size);
+
+// Large block functions
+void *map_block(size_t size);
+
+void *map_aligned_block(size_t alignment, size_t size);
+
+void unmap_block(s_block_ptr block);
+
+void *remap_block(s_block_ptr block, size_t size);
+
+// Thread cache functions
+thread_cache_ptr get_thread_cache(void);
+
+void *cache_malloc(thread_cache_ptr cache, size_t size);
+
+void cache_free(thread_cache_ptr cache, s_block_ptr block);
+
+void refill_cache(thread_cache_ptr cache, size_t size);
+
+void drain_remote_frees(thread_cache_ptr cache);
+
+void flush_cache(thread_cache_ptr cache);
+
+void *quick_malloc(thread_cache_ptr cache, int bin);
+
+void quick_free(thread_cache_ptr cache, s_block_ptr block);
+
+void consolidate_quick(thread_cache_ptr cache);
+
+// Object pool functions
+mm_pool_ptr mm_pool_create(size_t obj_size);
+
+void *mm_pool_alloc(mm_pool_ptr pool);
+
+void mm_pool_free(mm_pool_ptr pool, void *ptr);
+
+void mm_pool_destroy(mm_pool_ptr pool);
+
+pool_slab_ptr new_slab(mm_pool_ptr pool);
+
+void release_slab(mm_pool_ptr pool, pool_slab_ptr slab);
+
+// Shared-memory heap functions
+mm_shm_ptr mm_shm_create(void *region, size_t size);
+
+mm_shm_ptr mm_shm_attach(void *region);
+
+void *mm_shm_alloc(mm_shm_ptr shm, size_t size);
+
+void mm_shm_free(mm_shm_ptr shm, void *ptr);
+
+size_t mm_shm_offset(mm_shm_ptr shm, void *ptr);
+
+void *mm_shm_pointer(mm_shm_ptr shm, size_t offset);
+
+void mm_shm_destroy(mm_shm_ptr shm);
+
+// Heap profile functions
+void profile_sample(void *ptr, size_t size);
+
+void profile_forget(void *ptr);
+
+// Arena functions
+mm_arena_ptr mm_arena_create(void *buffer, size_t size);
+
+void *mm_arena_alloc(mm_arena_ptr arena, size_t size);
+
+void mm_arena_reset(mm_arena_ptr arena);
+
+void mm_arena_destroy(mm_arena_ptr arena);
+
+void *arena_grow(mm_arena_ptr arena, size_t size);
 
 #ifdef __cplusplus
 }
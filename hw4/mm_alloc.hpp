@@ -0,0 +1,217 @@
+#pragma once
+
+#ifndef _malloc_HPP_
+#define _malloc_HPP_
+
+/* C++ front ends for mm_alloc: an allocator for standard containers, and
+ * std::pmr memory resources over the heap, an arena and a pool. Header
+ * only; link with mm_alloc.o as usual. */
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "mm_alloc.h"
+
+namespace mm {
+
+/* Take bytes from the heap with at least the given alignment. Throws
+ * std::bad_alloc rather than returning NULL, as C++ callers expect. */
+inline void *heap_allocate(std::size_t bytes, std::size_t alignment) {
+    /* mm_malloc turns down empty requests, C++ wants a unique pointer */
+    bytes = bytes != 0 ? bytes : 1;
+    void *ptr = alignment > ALIGNMENT ? mm_memalign(alignment, bytes) : mm_malloc(bytes);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+/* Allocator for containers, as in std::vector<int, mm::allocator<int>>.
+ * It has no state, so all of them are equal and any one can free what
+ * another allocated. */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_move_assignment = std::true_type;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(heap_allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        mm_free(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+/* The heap as a memory resource; get one through mm::heap_resource() */
+class heap_memory_resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return heap_allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        mm_free(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const heap_memory_resource *>(&other) != nullptr;
+    }
+};
+
+inline std::pmr::memory_resource *heap_resource() noexcept {
+    static heap_memory_resource resource;
+    return &resource;
+}
+
+/* Memory resource over an mm_arena. Allocating bumps a pointer and
+ * deallocate does nothing; it all goes at once on release() or when the
+ * resource is destroyed. Not thread-safe, like the arena itself. */
+class arena_resource : public std::pmr::memory_resource {
+public:
+    /* The first chunk comes from the heap */
+    explicit arena_resource(std::size_t size = ARENA_DEFAULT_SIZE) : arena_resource(nullptr, size) {}
+
+    /* The first chunk is the caller's buffer, which must outlive the
+     * resource; say one on the stack */
+    arena_resource(void *buffer, std::size_t size) : arena_(mm_arena_create(buffer, size)) {
+        if (arena_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    arena_resource(const arena_resource &) = delete;
+    arena_resource &operator=(const arena_resource &) = delete;
+
+    ~arena_resource() override {
+        mm_arena_destroy(arena_);
+    }
+
+    /* Frees everything allocated so far; the arena stays usable */
+    void release() noexcept {
+        mm_arena_reset(arena_);
+    }
+
+    mm_arena_ptr arena() const noexcept {
+        return arena_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        /* The arena hands out ALIGNMENT; for more, take the worst case
+         * of padding and round up within it */
+        std::size_t padding = alignment > ALIGNMENT ? alignment - ALIGNMENT : 0;
+        if (bytes > PTRDIFF_MAX - padding) {
+            throw std::bad_alloc();
+        }
+        char *ptr = static_cast<char *>(mm_arena_alloc(arena_, bytes + padding));
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<void *>((reinterpret_cast<std::size_t>(ptr) + padding) & ~(alignment - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    mm_arena_ptr arena_;
+};
+
+/* Memory resource over an mm_pool. Requests that fit a slot are served by
+ * the pool; bigger or more aligned ones go to the upstream resource, the
+ * heap unless told otherwise. Suits node-based containers, whose nodes
+ * are all one size. Thread-safe if upstream is. */
+class pool_resource : public std::pmr::memory_resource {
+public:
+    explicit pool_resource(std::size_t slot_size, std::pmr::memory_resource *upstream = heap_resource())
+        : pool_(mm_pool_create(slot_size)), upstream_(upstream) {
+        if (pool_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    pool_resource(const pool_resource &) = delete;
+    pool_resource &operator=(const pool_resource &) = delete;
+
+    ~pool_resource() override {
+        mm_pool_destroy(pool_);
+    }
+
+    std::size_t slot_size() const noexcept {
+        return pool_->slot_size;
+    }
+
+    std::pmr::memory_resource *upstream_resource() const noexcept {
+        return upstream_;
+    }
+
+    mm_pool_ptr pool() const noexcept {
+        return pool_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (!fits(bytes, alignment)) {
+            return upstream_->allocate(bytes, alignment);
+        }
+        void *ptr = mm_pool_alloc(pool_);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override {
+        if (fits(bytes, alignment)) {
+            mm_pool_free(pool_, ptr);
+        } else {
+            upstream_->deallocate(ptr, bytes, alignment);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    bool fits(std::size_t bytes, std::size_t alignment) const noexcept {
+        return bytes <= pool_->slot_size && alignment <= ALIGNMENT;
+    }
+
+    mm_pool_ptr pool_;
+    std::pmr::memory_resource *upstream_;
+};
+
+} // namespace mm
+
+#endif
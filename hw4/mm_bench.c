@@ -0,0 +1,649 @@
+/* Micro-benchmarks for the allocator. Run with no arguments for all of them,
+ * or name the ones to run. */
+
+#include "mm_alloc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cost of mm_free as the number of live blocks grows. Every other block is
+ * freed so no coalescing happens and only the header lookup is measured; the
+ * rest stay live so each round runs on a bigger heap than the last. */
+static void bench_free(void)
+{
+    static const size_t counts[] = {1000, 10000, 100000, 1000000, 2000000};
+    void **ptrs = malloc(counts[4] * sizeof(void *));
+
+    printf("free: ns per mm_free by live blocks\n");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        size_t n = counts[c];
+        for (size_t i = 0; i < n; i++) {
+            ptrs[i] = mm_malloc(16);
+        }
+        double start = now();
+        for (size_t i = 0; i < n; i += 2) {
+            mm_free(ptrs[i]);
+        }
+        double elapsed = now() - start;
+        printf("  %8zu blocks: %6.1f ns\n", n, elapsed * 1e9 / (n / 2));
+    }
+    free(ptrs);
+}
+
+#define RING_SIZE 1024
+#define PC_OPS 200000
+#define PC_MAX_THREADS 16
+
+/* Single-producer single-consumer ring between neighbouring threads */
+struct ring {
+    void *slots[RING_SIZE];
+    unsigned long head;
+    unsigned long tail;
+} __attribute__((aligned(64)));
+
+struct pc_thread {
+    struct ring *in;
+    struct ring *out;
+    pthread_t thread;
+};
+
+static int ring_push(struct ring *r, void *p)
+{
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        return 0;
+    }
+    r->slots[tail % RING_SIZE] = p;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *ring_pop(struct ring *r)
+{
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    void *p = r->slots[head % RING_SIZE];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+static void *pc_worker(void *arg)
+{
+    struct pc_thread *self = arg;
+    for (int i = 0; i < PC_OPS; i++) {
+        void *p = mm_malloc(16 + i % 112);
+        if (!ring_push(self->out, p)) {
+            mm_free(p);
+        }
+        mm_free(ring_pop(self->in));
+    }
+    return NULL;
+}
+
+/* Every thread allocates into a ring read by the next thread, which frees
+ * the blocks, so most frees cross threads */
+static void bench_threads(void)
+{
+    static struct ring rings[PC_MAX_THREADS];
+    struct pc_thread workers[PC_MAX_THREADS];
+
+    printf("threads: producer/consumer malloc+free pairs\n");
+    for (int n = 1; n <= PC_MAX_THREADS; n *= 2) {
+        memset(rings, 0, sizeof(rings));
+        struct mm_stats before, after;
+        mm_stats(&before);
+        double start = now();
+        for (int i = 0; i < n; i++) {
+            workers[i].out = &rings[i];
+            workers[i].in = &rings[(i + n - 1) % n];
+            pthread_create(&workers[i].thread, NULL, pc_worker, &workers[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        double elapsed = now() - start;
+        for (int i = 0; i < n; i++) {
+            void *p;
+            while ((p = ring_pop(&rings[i])) != NULL) {
+                mm_free(p);
+            }
+        }
+        mm_stats(&after);
+        /* Each op is a malloc and a free; the lock counts say how much of
+         * that reached the shared heap */
+        unsigned long locks = after.heap_locks - before.heap_locks;
+        unsigned long waits = after.heap_lock_waits - before.heap_lock_waits;
+        printf("  %2d threads: %7.2f Mops/s, heap lock %5.1f times per 1000 ops, %lu waits\n", n,
+               n * (double) PC_OPS / elapsed / 1e6, locks * 1000.0 / (n * (double) PC_OPS), waits);
+    }
+}
+
+#define CHURN_ROUNDS 20
+#define CHURN_BLOCKS 20000
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void churn(const char *label, size_t min_size, size_t max_size)
+{
+    static void *ptrs[CHURN_BLOCKS];
+    unsigned int seed = 162;
+    char *brk_start = sbrk(0);
+
+    double start = now();
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        int n = CHURN_BLOCKS / (1 + round % 4);
+        for (int i = 0; i < n; i++) {
+            ptrs[i] = mm_malloc(min_size + rand_r(&seed) % (max_size - min_size + 1));
+        }
+        for (int i = 0; i < n; i++) {
+            mm_free(ptrs[i]);
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("  %s: time %.1f ms, peak RSS %ld KB, break left %ld KB above start\n",
+           label, elapsed * 1e3, peak_rss_kb(), (long) ((char *) sbrk(0) - brk_start) / 1024);
+}
+
+/* Waves of allocations that build up and are then freed. The heap size
+ * changes a lot between peaks, so growth and trimming both matter. Small
+ * blocks parked in the thread cache can pin the top of the heap, so the
+ * second run keeps to sizes the cache does not take. */
+static void bench_churn(void)
+{
+    printf("churn: %d rounds of up to %d blocks\n", CHURN_ROUNDS, CHURN_BLOCKS);
+    churn("1-4096 bytes", 1, 4096);
+    churn("257-4096 bytes", CACHE_LIMIT + 1, 4096);
+}
+
+#define MAX_VECTORS 64
+#define VECTOR_MAX (64 * 1024)
+
+/* Vectors grown by half again at a time, the way a dynamic array does,
+ * with short-lived allocations mixed in between resizes. With more vectors
+ * their neighbours are less often free, so more resizes have to copy. */
+static void bench_realloc(void)
+{
+    void *vectors[MAX_VECTORS];
+    size_t sizes[MAX_VECTORS];
+
+    printf("realloc: vector growth to %d KB\n", VECTOR_MAX / 1024);
+    for (int count = 1; count <= MAX_VECTORS; count *= 4) {
+        double start = now();
+        long resizes = 0;
+        for (int round = 0; round < 20; round++) {
+            for (int v = 0; v < count; v++) {
+                sizes[v] = 16;
+                vectors[v] = mm_malloc(sizes[v]);
+            }
+            for (int done = 0; done < count;) {
+                done = 0;
+                for (int v = 0; v < count; v++) {
+                    if (sizes[v] >= VECTOR_MAX) {
+                        done++;
+                        continue;
+                    }
+                    sizes[v] += sizes[v] / 2;
+                    vectors[v] = mm_realloc(vectors[v], sizes[v]);
+                    mm_free(mm_malloc(sizes[v] / 4));
+                    resizes++;
+                }
+            }
+            for (int v = 0; v < count; v++) {
+                mm_free(vectors[v]);
+            }
+        }
+        double elapsed = now() - start;
+        printf("  %2d vectors: %6.1f ns per resize\n", count, elapsed * 1e9 / resizes);
+    }
+}
+
+#define OVERHEAD_OBJECTS 100000
+#define OVERHEAD_MAX_STRIDE 4096
+
+/* Heap bytes spent per small object, header and rounding included: the
+ * most common distance between objects allocated back to back. That holds
+ * up even when earlier benches left the heap fragmented. */
+static void bench_overhead(void)
+{
+    static const size_t sizes[] = {8, 16, 24, 32, 48, 64};
+    static char *ptrs[OVERHEAD_OBJECTS];
+    static int strides[OVERHEAD_MAX_STRIDE];
+
+    printf("overhead: heap bytes per object, %d objects\n", OVERHEAD_OBJECTS);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        memset(strides, 0, sizeof(strides));
+        for (int i = 0; i < OVERHEAD_OBJECTS; i++) {
+            ptrs[i] = mm_malloc(sizes[s]);
+            if (i > 0) {
+                long stride = labs(ptrs[i] - ptrs[i - 1]);
+                if (stride < OVERHEAD_MAX_STRIDE) {
+                    strides[stride]++;
+                }
+            }
+        }
+        int common = 1;
+        for (int i = 1; i < OVERHEAD_MAX_STRIDE; i++) {
+            if (strides[i] > strides[common]) {
+                common = i;
+            }
+        }
+        printf("  %3zu bytes: %4d bytes each, %5.1f%% useful\n",
+               sizes[s], common, 100.0 * sizes[s] / common);
+        for (int i = 0; i < OVERHEAD_OBJECTS; i++) {
+            mm_free(ptrs[i]);
+        }
+    }
+}
+
+#define POOL_OBJECTS 10000
+#define POOL_ROUNDS 100
+#define POOL_OBJECT_SIZE 48
+
+/* Fixed-size objects allocated in bulk and freed, through mm_malloc and
+ * through a pool */
+static void bench_pool(void)
+{
+    static void *ptrs[POOL_OBJECTS];
+
+    printf("pool: %d-byte objects, ns per alloc+free\n", POOL_OBJECT_SIZE);
+    double start = now();
+    for (int round = 0; round < POOL_ROUNDS; round++) {
+        for (int i = 0; i < POOL_OBJECTS; i++) {
+            ptrs[i] = mm_malloc(POOL_OBJECT_SIZE);
+        }
+        for (int i = 0; i < POOL_OBJECTS; i++) {
+            mm_free(ptrs[i]);
+        }
+    }
+    double elapsed = now() - start;
+    printf("  mm_malloc: %6.1f ns\n", elapsed * 1e9 / (POOL_ROUNDS * POOL_OBJECTS));
+
+    mm_pool_ptr pool = mm_pool_create(POOL_OBJECT_SIZE);
+    start = now();
+    for (int round = 0; round < POOL_ROUNDS; round++) {
+        for (int i = 0; i < POOL_OBJECTS; i++) {
+            ptrs[i] = mm_pool_alloc(pool);
+        }
+        for (int i = 0; i < POOL_OBJECTS; i++) {
+            mm_pool_free(pool, ptrs[i]);
+        }
+    }
+    elapsed = now() - start;
+    printf("  mm_pool:   %6.1f ns\n", elapsed * 1e9 / (POOL_ROUNDS * POOL_OBJECTS));
+    mm_pool_destroy(pool);
+}
+
+#define REQUESTS 100000
+#define REQUEST_BUFFERS 32
+
+/* Request-shaped load: a few dozen buffers of assorted sizes that all die
+ * when the request is done, freed one by one or dropped with an arena
+ * reset */
+static void bench_arena(void)
+{
+    void *buffers[REQUEST_BUFFERS];
+    char inline_chunk[4096];
+    unsigned int seed = 162;
+    size_t sizes[REQUEST_BUFFERS];
+    for (int i = 0; i < REQUEST_BUFFERS; i++) {
+        sizes[i] = 16 + rand_r(&seed) % 240;
+    }
+
+    printf("arena: %d buffers per request, ns per request\n", REQUEST_BUFFERS);
+    double start = now();
+    for (int r = 0; r < REQUESTS; r++) {
+        for (int i = 0; i < REQUEST_BUFFERS; i++) {
+            buffers[i] = mm_malloc(sizes[i]);
+        }
+        for (int i = 0; i < REQUEST_BUFFERS; i++) {
+            mm_free(buffers[i]);
+        }
+    }
+    double elapsed = now() - start;
+    printf("  mm_malloc/mm_free: %7.1f ns\n", elapsed * 1e9 / REQUESTS);
+
+    mm_arena_ptr arena = mm_arena_create(inline_chunk, sizeof(inline_chunk));
+    start = now();
+    for (int r = 0; r < REQUESTS; r++) {
+        for (int i = 0; i < REQUEST_BUFFERS; i++) {
+            buffers[i] = mm_arena_alloc(arena, sizes[i]);
+        }
+        mm_arena_reset(arena);
+    }
+    elapsed = now() - start;
+    printf("  arena:             %7.1f ns\n", elapsed * 1e9 / REQUESTS);
+    mm_arena_destroy(arena);
+}
+
+#define BATCH_OBJECTS 1000
+#define BATCH_ROUNDS 1000
+
+/* A batch of same-sized objects, one call at a time and in one call each
+ * way, for a cached size and a heap size */
+static void bench_batch(void)
+{
+    static void *ptrs[BATCH_OBJECTS];
+    static const size_t sizes[] = {48, 400};
+
+    printf("batch: %d objects, ns per alloc+free\n", BATCH_OBJECTS);
+    for (int s = 0; s < 2; s++) {
+        double start = now();
+        for (int round = 0; round < BATCH_ROUNDS; round++) {
+            for (int i = 0; i < BATCH_OBJECTS; i++) {
+                ptrs[i] = mm_malloc(sizes[s]);
+            }
+            for (int i = 0; i < BATCH_OBJECTS; i++) {
+                mm_free(ptrs[i]);
+            }
+        }
+        double elapsed = now() - start;
+        printf("  %3zu bytes, mm_malloc:       %6.1f ns\n", sizes[s],
+               elapsed * 1e9 / (BATCH_ROUNDS * BATCH_OBJECTS));
+
+        start = now();
+        for (int round = 0; round < BATCH_ROUNDS; round++) {
+            mm_malloc_batch(sizes[s], BATCH_OBJECTS, ptrs);
+            mm_free_batch(ptrs, BATCH_OBJECTS);
+        }
+        elapsed = now() - start;
+        printf("  %3zu bytes, mm_malloc_batch: %6.1f ns\n", sizes[s],
+               elapsed * 1e9 / (BATCH_ROUNDS * BATCH_OBJECTS));
+    }
+}
+
+#define PINGPONG_OPS 10000000
+
+/* A malloc and free of the same size over and over, for sizes served by
+ * the thread cache, the heap and mappings */
+static void bench_pingpong(void)
+{
+    static const size_t sizes[] = {48, 400, 1000, 4000};
+
+    printf("pingpong: ns per malloc+free\n");
+    for (int s = 0; s < 4; s++) {
+        double start = now();
+        for (int i = 0; i < PINGPONG_OPS; i++) {
+            char *ptr = mm_malloc(sizes[s]);
+            ptr[0] = 1;
+            mm_free(ptr);
+        }
+        double elapsed = now() - start;
+        printf("  %4zu bytes: %6.1f ns\n", sizes[s], elapsed * 1e9 / PINGPONG_OPS);
+    }
+}
+
+#define CHASE_NODES (4 * 1024 * 1024)
+#define CHASE_STEPS 10000000
+
+struct chase_node {
+    struct chase_node *next;
+    char pad[40];
+};
+
+/* One walk, in a process of its own so the heap mode can still be set */
+static void chase(int huge)
+{
+    mm_config(MM_HUGE_PAGES, huge);
+    struct chase_node **nodes = malloc(CHASE_NODES * sizeof(struct chase_node *));
+    for (int i = 0; i < CHASE_NODES; i++) {
+        nodes[i] = mm_malloc(sizeof(struct chase_node));
+    }
+    /* Sattolo's shuffle, so the links form one cycle through every node */
+    unsigned int seed = 162;
+    for (int i = CHASE_NODES - 1; i > 0; i--) {
+        int j = rand_r(&seed) % i;
+        struct chase_node *swap = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = swap;
+    }
+    for (int i = 0; i < CHASE_NODES; i++) {
+        nodes[i]->next = nodes[(i + 1) % CHASE_NODES];
+    }
+
+    struct chase_node *node = nodes[0];
+    double start = now();
+    for (int i = 0; i < CHASE_STEPS; i++) {
+        node = node->next;
+    }
+    double elapsed = now() - start;
+
+    struct mm_stats stats;
+    mm_stats(&stats);
+    printf("  %s %6.1f ns per hop, %zu of %zu MB in huge pages%s\n", huge ? "huge:" : "sbrk:",
+           elapsed * 1e9 / CHASE_STEPS, stats.huge_bytes >> 20, stats.heap_bytes >> 20,
+           node == NULL ? "?" : "");
+    free(nodes);
+}
+
+/* Pointer chasing over a heap much larger than the TLB covers, with the
+ * heap on sbrk and in huge pages */
+static void bench_chase(void)
+{
+    printf("chase: random walk over %d MB of nodes\n", CHASE_NODES * 64 >> 20);
+    fflush(stdout);
+    for (int huge = 0; huge < 2; huge++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl("/proc/self/exe", "mm_bench", "--chase", huge ? "1" : "0", (char *) NULL);
+            _exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+}
+
+#define TRIM_BLOCKS 8192
+#define TRIM_BLOCK_SIZE 8000
+#define TRIM_KEEP_EVERY 128
+
+static long current_rss_kb(void)
+{
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* A heap mostly freed but pinned by a few live blocks, so nothing can come
+ * off the top: resident memory once the frees are done and after mm_trim,
+ * with and without purging at the trim threshold */
+static void bench_trim(void)
+{
+    static void *ptrs[TRIM_BLOCKS];
+
+    printf("trim: %d MB freed around a live block every %d, RSS in MB\n",
+           TRIM_BLOCKS * TRIM_BLOCK_SIZE >> 20, TRIM_KEEP_EVERY);
+    for (int automatic = 1; automatic >= 0; automatic--) {
+        mm_config(MM_TRIM_THRESHOLD, automatic ? DEFAULT_TRIM_THRESHOLD : (size_t) -1);
+        for (int i = 0; i < TRIM_BLOCKS; i++) {
+            ptrs[i] = mm_malloc(TRIM_BLOCK_SIZE);
+            memset(ptrs[i], 1, TRIM_BLOCK_SIZE);
+        }
+        long allocated = current_rss_kb();
+        for (int i = 0; i < TRIM_BLOCKS; i++) {
+            if (i % TRIM_KEEP_EVERY != 0) {
+                mm_free(ptrs[i]);
+            }
+        }
+        long freed = current_rss_kb();
+        double start = now();
+        mm_trim();
+        double elapsed = now() - start;
+        printf("  %s allocated %4ld, freed %4ld, mm_trim %4ld (%.2f ms)\n",
+               automatic ? "threshold:" : "no purge: ", allocated >> 10, freed >> 10,
+               current_rss_kb() >> 10, elapsed * 1e3);
+        for (int i = 0; i < TRIM_BLOCKS; i += TRIM_KEEP_EVERY) {
+            mm_free(ptrs[i]);
+        }
+    }
+    mm_config(MM_TRIM_THRESHOLD, DEFAULT_TRIM_THRESHOLD);
+}
+
+#define PROFILE_OPS 2000000
+#define PROFILE_SLOTS 4096
+#define PROFILE_MAX_SIZE 4096
+#define PROFILE_ROUNDS 5
+
+/* A steady mix of mallocs and frees of random sizes, ns per pair */
+static double profile_run(void)
+{
+    static void *slots[PROFILE_SLOTS];
+    unsigned int seed = 162;
+
+    double start = now();
+    for (int i = 0; i < PROFILE_OPS; i++) {
+        int slot = rand_r(&seed) % PROFILE_SLOTS;
+        mm_free(slots[slot]);
+        slots[slot] = mm_malloc(1 + rand_r(&seed) % PROFILE_MAX_SIZE);
+    }
+    double elapsed = now() - start;
+    for (int slot = 0; slot < PROFILE_SLOTS; slot++) {
+        mm_free(slots[slot]);
+        slots[slot] = NULL;
+    }
+    return elapsed * 1e9 / PROFILE_OPS;
+}
+
+/* What heap profiling costs at the default interval. Runs alternate and
+ * the best of each is kept, since the difference is within the noise of
+ * a single run; the first run only warms up the heap. */
+static void bench_profile(void)
+{
+    printf("profile: ns per malloc+free, sampling every %d KB on average\n", DEFAULT_PROFILE_INTERVAL >> 10);
+    profile_run();
+    double off = 1e9;
+    double on = 1e9;
+    for (int round = 0; round < PROFILE_ROUNDS; round++) {
+        double t = profile_run();
+        off = t < off ? t : off;
+        mm_config(MM_PROFILE_INTERVAL, DEFAULT_PROFILE_INTERVAL);
+        t = profile_run();
+        on = t < on ? t : on;
+        mm_config(MM_PROFILE_INTERVAL, 0);
+    }
+
+    struct mm_stats stats;
+    mm_stats(&stats);
+    printf("  off: %6.1f ns\n", off);
+    printf("  on:  %6.1f ns (%+.1f%%), %lu samples dropped\n", on, (on / off - 1) * 100, stats.profile_dropped);
+}
+
+#define SHM_REGION (64 * 1024 * 1024)
+#define SHM_PROCESSES 2
+
+/* profile_run's mix on a shared-memory heap */
+static double shm_run(mm_shm_ptr shm)
+{
+    static void *slots[PROFILE_SLOTS];
+    unsigned int seed = 162;
+
+    double start = now();
+    for (int i = 0; i < PROFILE_OPS; i++) {
+        int slot = rand_r(&seed) % PROFILE_SLOTS;
+        mm_shm_free(shm, slots[slot]);
+        slots[slot] = mm_shm_alloc(shm, 1 + rand_r(&seed) % PROFILE_MAX_SIZE);
+    }
+    double elapsed = now() - start;
+    for (int slot = 0; slot < PROFILE_SLOTS; slot++) {
+        mm_shm_free(shm, slots[slot]);
+        slots[slot] = NULL;
+    }
+    return elapsed * 1e9 / PROFILE_OPS;
+}
+
+/* The shared-memory heap against the process heap on the same mix, then
+ * with several processes sharing it at once, ns per malloc+free */
+static void bench_shm(void)
+{
+    void *region = mmap(NULL, SHM_REGION, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    mm_shm_ptr shm = region == MAP_FAILED ? NULL : mm_shm_create(region, SHM_REGION);
+    if (shm == NULL) {
+        return;
+    }
+
+    printf("shm: ns per malloc+free\n");
+    profile_run();
+    printf("  mm_malloc:             %6.1f ns\n", profile_run());
+    shm_run(shm);
+    printf("  mm_shm_alloc:          %6.1f ns\n", shm_run(shm));
+
+    double start = now();
+    for (int p = 0; p < SHM_PROCESSES; p++) {
+        if (fork() == 0) {
+            shm_run(shm);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    double elapsed = now() - start;
+    printf("  mm_shm_alloc, %d procs: %6.1f ns\n", SHM_PROCESSES, elapsed * 1e9 / (SHM_PROCESSES * PROFILE_OPS));
+    mm_shm_destroy(shm);
+    munmap(region, SHM_REGION);
+}
+
+struct bench {
+    const char *name;
+    void (*run)(void);
+};
+
+static const struct bench benches[] = {
+    {"free", bench_free},
+    {"threads", bench_threads},
+    {"churn", bench_churn},
+    {"realloc", bench_realloc},
+    {"overhead", bench_overhead},
+    {"pool", bench_pool},
+    {"arena", bench_arena},
+    {"batch", bench_batch},
+    {"pingpong", bench_pingpong},
+    {"chase", bench_chase},
+    {"trim", bench_trim},
+    {"profile", bench_profile},
+    {"shm", bench_shm},
+};
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--chase") == 0) {
+        chase(atoi(argv[2]));
+        return 0;
+    }
+
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    for (size_t i = 0; i < count; i++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], benches[i].name) == 0;
+        }
+        if (selected) {
+            benches[i].run();
+        }
+    }
+    return 0;
+}
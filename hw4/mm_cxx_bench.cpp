@@ -0,0 +1,160 @@
+/* Container workloads on mm_alloc against std::allocator. Run with no
+ * arguments for all of them, or name the ones to run. */
+
+#include "mm_alloc.hpp"
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define VECTOR_COUNT 1000
+#define VECTOR_LENGTH 1000
+#define VECTOR_ROUNDS 20
+
+/* Many vectors grown one push_back at a time, so each one goes through
+ * a string of reallocations, and then all dropped together */
+template <class Vector, class... Args>
+static double vectors(Args &&...args)
+{
+    double start = now();
+    for (int round = 0; round < VECTOR_ROUNDS; round++) {
+        std::vector<Vector> all;
+        all.reserve(VECTOR_COUNT);
+        for (int v = 0; v < VECTOR_COUNT; v++) {
+            all.emplace_back(args...);
+            for (int i = 0; i < VECTOR_LENGTH; i++) {
+                all.back().push_back(i);
+            }
+        }
+    }
+    return (now() - start) * 1e3;
+}
+
+static void bench_vector()
+{
+    printf("vector: %d rounds of %d vectors of %d ints, ms\n", VECTOR_ROUNDS, VECTOR_COUNT, VECTOR_LENGTH);
+    printf("  std::allocator: %6.1f\n", vectors<std::vector<int>>());
+    printf("  mm::allocator:  %6.1f\n", vectors<std::vector<int, mm::allocator<int>>>());
+    printf("  pmr heap:       %6.1f\n", vectors<std::pmr::vector<int>>(mm::heap_resource()));
+}
+
+#define MAP_KEYS 200000
+#define MAP_ROUNDS 5
+
+/* Insert a run of keys, erase every other one and fill the gaps again:
+ * one node allocation or free per operation */
+template <class Map, class... Args>
+static double maps(Args &&...args)
+{
+    double start = now();
+    for (int round = 0; round < MAP_ROUNDS; round++) {
+        Map map(args...);
+        for (int i = 0; i < MAP_KEYS; i++) {
+            map[i] = i;
+        }
+        for (int i = 0; i < MAP_KEYS; i += 2) {
+            map.erase(i);
+        }
+        for (int i = 0; i < MAP_KEYS; i += 2) {
+            map[i] = i;
+        }
+    }
+    return (now() - start) * 1e3;
+}
+
+template <class Key, class Value>
+using mm_unordered_map = std::unordered_map<Key, Value, std::hash<Key>, std::equal_to<Key>,
+                                            mm::allocator<std::pair<const Key, Value>>>;
+
+template <class Key, class Value>
+using mm_map = std::map<Key, Value, std::less<Key>, mm::allocator<std::pair<const Key, Value>>>;
+
+static void bench_map()
+{
+    printf("map: %d rounds of %d inserts, %d erases and %d inserts, ms\n", MAP_ROUNDS, MAP_KEYS,
+           MAP_KEYS / 2, MAP_KEYS / 2);
+    /* Nodes are all one size, which is what the pool is for */
+    mm::pool_resource pool(64);
+    printf("  unordered_map std::allocator: %6.1f\n", maps<std::unordered_map<int, int>>());
+    printf("  unordered_map mm::allocator:  %6.1f\n", maps<mm_unordered_map<int, int>>());
+    printf("  unordered_map pmr pool:       %6.1f\n", maps<std::pmr::unordered_map<int, int>>(&pool));
+    printf("  map std::allocator:           %6.1f\n", maps<std::map<int, int>>());
+    printf("  map mm::allocator:            %6.1f\n", maps<mm_map<int, int>>());
+    printf("  map pmr pool:                 %6.1f\n", maps<std::pmr::map<int, int>>(&pool));
+}
+
+#define LIST_LENGTH 100000
+#define LIST_ROUNDS 20
+
+/* Lists built and dropped whole, a node at a time */
+template <class List, class... Args>
+static double lists(Args &&...args)
+{
+    double start = now();
+    for (int round = 0; round < LIST_ROUNDS; round++) {
+        List list(args...);
+        for (int i = 0; i < LIST_LENGTH; i++) {
+            list.push_back(i);
+        }
+    }
+    return (now() - start) * 1e3;
+}
+
+static void bench_list()
+{
+    printf("list: %d rounds of building a %d element list, ms\n", LIST_ROUNDS, LIST_LENGTH);
+    mm::pool_resource pool(32);
+    printf("  std::allocator: %6.1f\n", lists<std::list<int>>());
+    printf("  mm::allocator:  %6.1f\n", lists<std::list<int, mm::allocator<int>>>());
+    printf("  pmr pool:       %6.1f\n", lists<std::pmr::list<int>>(&pool));
+
+    /* The case an arena is made for: the list is never destroyed, the
+     * arena is released under it instead */
+    mm::arena_resource arena;
+    double start = now();
+    for (int round = 0; round < LIST_ROUNDS; round++) {
+        auto *list = new (arena.allocate(sizeof(std::pmr::list<int>))) std::pmr::list<int>(&arena);
+        for (int i = 0; i < LIST_LENGTH; i++) {
+            list->push_back(i);
+        }
+        arena.release();
+    }
+    printf("  pmr arena:      %6.1f\n", (now() - start) * 1e3);
+}
+
+struct bench {
+    const char *name;
+    void (*run)();
+};
+
+static const struct bench benches[] = {
+    {"vector", bench_vector},
+    {"map", bench_map},
+    {"list", bench_list},
+};
+
+int main(int argc, char **argv)
+{
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    for (size_t i = 0; i < count; i++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], benches[i].name) == 0;
+        }
+        if (selected) {
+            benches[i].run();
+        }
+    }
+    return 0;
+}
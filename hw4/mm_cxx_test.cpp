@@ -0,0 +1,177 @@
+/* Tests for the C++ allocator and memory resources in mm_alloc.hpp. */
+
+#include "mm_alloc.hpp"
+#include <cstdio>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define VECTOR_ELEMENTS 100000
+#define MAP_ELEMENTS 10000
+#define LIST_ELEMENTS 10000
+
+struct alignas(64) wide {
+    char bytes[64];
+};
+
+static int allocator_test()
+{
+    std::vector<int, mm::allocator<int>> numbers;
+    for (int i = 0; i < VECTOR_ELEMENTS; i++) {
+        numbers.push_back(i);
+    }
+    for (int i = 0; i < VECTOR_ELEMENTS; i++) {
+        if (numbers[i] != i) {
+            return 0;
+        }
+    }
+    /* Small enough to stay on the heap, so its header must be there */
+    std::vector<int, mm::allocator<int>> few(100);
+    if (get_block(few.data()) == NULL) {
+        return 0;
+    }
+
+    /* Containers rebind the allocator to their node types */
+    using entry = std::pair<const std::string, int>;
+    std::map<std::string, int, std::less<std::string>, mm::allocator<entry>> names;
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, mm::allocator<std::pair<const int, int>>> squares;
+    for (int i = 0; i < MAP_ELEMENTS; i++) {
+        names[std::to_string(i)] = i;
+        squares[i] = i * i;
+    }
+    for (int i = 0; i < MAP_ELEMENTS; i++) {
+        if (names[std::to_string(i)] != i || squares[i] != i * i) {
+            return 0;
+        }
+    }
+
+    std::vector<wide, mm::allocator<wide>> wides(10);
+    if ((size_t) wides.data() % alignof(wide) != 0) {
+        return 0;
+    }
+
+    mm::allocator<long> longs;
+    if (longs != mm::allocator<char>()) {
+        return 0;
+    }
+    long *empty = longs.allocate(0);
+    if (empty == nullptr) {
+        return 0;
+    }
+    longs.deallocate(empty, 0);
+    try {
+        longs.allocate((size_t) -1 / 2);
+        return 0;
+    } catch (const std::bad_alloc &) {
+    }
+    return 1;
+}
+
+static int arena_resource_test()
+{
+    alignas(16) static char buffer[4096];
+    mm::arena_resource arena(buffer, sizeof(buffer));
+    {
+        std::pmr::vector<int> numbers(&arena);
+        numbers.reserve(10);
+        char *first = (char *) numbers.data();
+        if (first < buffer || first >= buffer + sizeof(buffer)) {
+            return 0;
+        }
+        /* Growing past the buffer chains on chunks from the heap */
+        for (int i = 0; i < VECTOR_ELEMENTS; i++) {
+            numbers.push_back(i);
+        }
+        for (int i = 0; i < VECTOR_ELEMENTS; i++) {
+            if (numbers[i] != i) {
+                return 0;
+            }
+        }
+    }
+
+    void *aligned = arena.allocate(100, 256);
+    if ((size_t) aligned % 256 != 0) {
+        return 0;
+    }
+
+    /* After a release the arena starts over at the front of the buffer */
+    arena.release();
+    void *again = arena.allocate(16);
+    if ((char *) again < buffer || (char *) again >= buffer + sizeof(buffer)) {
+        return 0;
+    }
+
+    mm::arena_resource other;
+    if (arena.is_equal(other) || !arena.is_equal(arena)) {
+        return 0;
+    }
+    return 1;
+}
+
+static int pool_resource_test()
+{
+    mm::pool_resource pool(64);
+    {
+        std::pmr::list<int> numbers(&pool);
+        for (int i = 0; i < LIST_ELEMENTS; i++) {
+            numbers.push_back(i);
+        }
+        int expected = 0;
+        for (int n : numbers) {
+            if (n != expected++) {
+                return 0;
+            }
+        }
+        if (pool.pool()->slabs < 2) {
+            return 0;
+        }
+    }
+    /* Every node went back, so only the spare slab is left */
+    if (pool.pool()->slabs != 1) {
+        return 0;
+    }
+
+    /* Too big for a slot, so it comes from the heap */
+    void *big = pool.allocate(1000);
+    if (get_block(big) == NULL) {
+        return 0;
+    }
+    pool.deallocate(big, 1000);
+
+    std::pmr::unordered_map<int, int> squares(&pool);
+    for (int i = 0; i < MAP_ELEMENTS; i++) {
+        squares[i] = i * i;
+    }
+    for (int i = 0; i < MAP_ELEMENTS; i++) {
+        if (squares[i] != i * i) {
+            return 0;
+        }
+    }
+    return mm::heap_resource()->is_equal(*mm::heap_resource());
+}
+
+int main(int argc, char **argv)
+{
+    if (!allocator_test()) {
+        printf("allocator test failed!\n");
+        return 1;
+    }
+    printf("allocator test successful!\n");
+
+    if (!arena_resource_test()) {
+        printf("arena resource test failed!\n");
+        return 1;
+    }
+    printf("arena resource test successful!\n");
+
+    if (!pool_resource_test()) {
+        printf("pool resource test failed!\n");
+        return 1;
+    }
+    printf("pool resource test successful!\n");
+    return 0;
+}
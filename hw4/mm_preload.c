@@ -0,0 +1,192 @@
+/* The standard malloc family on top of mm_alloc, for running unmodified
+ * programs under it:
+ *
+ *     make libmm_alloc.so
+ *     LD_PRELOAD=./libmm_alloc.so ls -l
+ *
+ * MM_STATS=exit prints mm_stats to stderr when the program exits, and
+ * MM_STATS=<signal number> prints them whenever that signal arrives.
+ * MM_TRACE=<file> records every call to file for mm_replay.
+ * MM_HUGE_PAGES=1 keeps the heap in huge pages (see mm_config).
+ * MM_PROFILE=<file> samples allocations and writes a heap profile of the
+ * ones still live to file at exit: folded stacks if the name ends in
+ * .folded, otherwise a pprof heap profile. MM_PROFILE_INTERVAL=<bytes>
+ * changes how far apart the samples are.
+ *
+ * The library is built with hidden visibility so only these functions are
+ * exported and none of the allocator's own names can clash with the
+ * program's. */
+
+#include "mm_alloc.h"
+#include "mm_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+static int tracing = 0;
+
+static void close_trace(void) {
+    tracing = 0;
+    mm_trace_close();
+}
+
+static const char *profile_path = NULL;
+static pid_t profile_pid;
+
+static void write_profile(void) {
+    /* A forked child exiting must not overwrite its parent's profile */
+    if (getpid() != profile_pid) {
+        return;
+    }
+    int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    size_t len = strlen(profile_path);
+    int folded = len >= 7 && strcmp(profile_path + len - 7, ".folded") == 0;
+    mm_profile_dump(fd, folded ? MM_PROFILE_FOLDED : MM_PROFILE_PPROF);
+    close(fd);
+}
+
+__attribute__((constructor)) static void preload_init(void) {
+    const char *stats = getenv("MM_STATS");
+    if (stats != NULL && strcmp(stats, "exit") == 0) {
+        mm_config(MM_STATS_AT_EXIT, STDERR_FILENO);
+    } else if (stats != NULL && atoi(stats) > 0) {
+        mm_config(MM_STATS_SIGNAL, atoi(stats));
+    }
+
+    const char *profile = getenv("MM_PROFILE");
+    if (profile != NULL && *profile != '\0') {
+        const char *interval = getenv("MM_PROFILE_INTERVAL");
+        size_t bytes = interval != NULL && atol(interval) > 0 ? (size_t) atol(interval) : DEFAULT_PROFILE_INTERVAL;
+        if (mm_config(MM_PROFILE_INTERVAL, bytes) == 0) {
+            profile_path = profile;
+            profile_pid = getpid();
+            atexit(write_profile);
+        }
+    }
+
+    /* A traced realloc holds the trace lock while it takes the heap lock,
+     * so fork must take them in that order too. Handlers registered later
+     * run first; allocating once here registers the heap's before the
+     * trace's. */
+    mm_free(mm_malloc(1));
+    const char *trace = getenv("MM_TRACE");
+    if (trace != NULL && mm_trace_open(trace) == 0) {
+        tracing = 1;
+        atexit(close_trace);
+    }
+}
+
+EXPORT void *malloc(size_t size) {
+    /* Callers take NULL from malloc(0) as out of memory */
+    void *ptr = mm_malloc(size == 0 ? 1 : size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    if (tracing) {
+        mm_trace_record(TRACE_MALLOC, NULL, size, ptr);
+    }
+    return ptr;
+}
+
+EXPORT void free(void *ptr) {
+    if (tracing && ptr != NULL) {
+        mm_trace_record(TRACE_FREE, ptr, 0, NULL);
+    }
+    mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t count, size_t size) {
+    void *ptr = mm_calloc(count, size);
+    if (ptr == NULL && count != 0 && size != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (ptr == NULL) {
+        return malloc(0);
+    }
+    if (tracing) {
+        mm_trace_record(TRACE_CALLOC, NULL, count * size, ptr);
+    }
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    /* Traced as one step, so no other thread's record of ptr or of the
+     * result can fall on the wrong side of this one */
+    int traced = tracing;
+    if (traced) {
+        mm_trace_begin();
+    }
+    void *new_ptr = mm_realloc(ptr, size);
+    if (new_ptr == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    if (traced) {
+        mm_trace_end(TRACE_REALLOC, ptr, size, new_ptr);
+    }
+    return new_ptr;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+EXPORT int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (alignment <= ALIGNMENT) {
+        void *ptr = malloc(size);
+        if (ptr == NULL) {
+            return ENOMEM;
+        }
+        *out = ptr;
+        return 0;
+    }
+    void *ptr = mm_memalign(alignment, size == 0 ? 1 : size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    if (tracing) {
+        mm_trace_record(TRACE_MALLOC, NULL, size, ptr);
+    }
+    *out = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = NULL;
+    int error = posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, size);
+    if (error != 0) {
+        errno = error;
+    }
+    return ptr;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
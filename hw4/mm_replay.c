@@ -0,0 +1,533 @@
+/* Replays allocation traces against glibc and against mm_alloc, each in a
+ * child process of its own so neither runs on a heap the other has used.
+ *
+ *     ./mm_replay traces/web.trace ...
+ *     ./mm_replay --generate traces
+ *
+ * Traces of real programs come from the preload library:
+ *
+ *     MM_TRACE=ls.trace LD_PRELOAD=./libmm_alloc.so ls -lR /usr >/dev/null
+ *     ./mm_replay ls.trace */
+
+#include "mm_alloc.h"
+#include "mm_trace.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_PAGE 4096
+
+/* A trace with its pointers turned into slot numbers. Slots are reused
+ * once freed, so the replay's pointer table stays as small as the peak
+ * number of live blocks. */
+struct replay_op {
+    uint64_t size;
+    uint32_t slot;
+    uint32_t op;
+};
+
+struct replay {
+    struct replay_op *ops;
+    size_t capacity;
+    size_t count;
+    size_t slots;
+    size_t peak_live;
+};
+
+struct allocator {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t count, size_t size);
+    /* Extra detail printed after the run, if the allocator has any */
+    void (*report)(void);
+};
+
+static void report_mm(void)
+{
+    struct mm_stats stats;
+    mm_stats(&stats);
+    printf("           heap %.1f MB with %.1f MB free, free space fragmentation %.3f, "
+           "%lu sbrk, %lu mmap, %lu mremap\n",
+           stats.heap_bytes / (double) (1 << 20), stats.free_bytes / (double) (1 << 20),
+           stats.fragmentation, stats.sbrk_calls, stats.mmap_calls, stats.mremap_calls);
+}
+
+static const struct allocator allocators[] = {
+    {"glibc", malloc, free, realloc, calloc, NULL},
+    {"mm_alloc", mm_malloc, mm_free, mm_realloc, mm_calloc, report_mm},
+};
+
+/* Everything the driver itself needs is mapped directly, so it lives in
+ * neither allocator's heap */
+static void *map_array(size_t bytes)
+{
+    void *ptr = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t current_rss(void)
+{
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static int get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; *pos < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*pos)++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Decode one record; 0 at the end of the trace or on a truncated record */
+static int next_record(const unsigned char **pos, const unsigned char *end, int *op,
+                       uint64_t *ptr, uint64_t *size, uint64_t *result)
+{
+    if (*pos >= end) {
+        return 0;
+    }
+    *op = *(*pos)++;
+    *ptr = *size = *result = 0;
+    if ((*op == TRACE_REALLOC || *op == TRACE_FREE) && !get_varint(pos, end, ptr)) {
+        return 0;
+    }
+    if (*op != TRACE_FREE && (!get_varint(pos, end, size) || !get_varint(pos, end, result))) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Address to slot table with open addressing. Freed entries become
+ * tombstones; the table is sized for every allocation in the trace, so it
+ * never fills up. */
+#define EMPTY_KEY 0
+#define DELETED_KEY 1
+
+struct slot_map {
+    uint64_t *keys;
+    uint32_t *values;
+    size_t mask;
+};
+
+static size_t map_find(struct slot_map *map, uint64_t key, int insert)
+{
+    size_t i = (key >> 4) * 0x9e3779b97f4a7c15ULL & map->mask;
+    while (map->keys[i] != EMPTY_KEY) {
+        if (map->keys[i] == key) {
+            return i;
+        }
+        i = (i + 1) & map->mask;
+    }
+    return insert ? i : (size_t) -1;
+}
+
+struct slot_state {
+    struct slot_map map;
+    uint32_t *free_slots;
+    size_t free_count;
+    uint64_t *sizes;
+    size_t live;
+};
+
+static uint32_t take_slot(struct replay *replay, struct slot_state *state, uint64_t address)
+{
+    uint32_t slot = state->free_count > 0 ? state->free_slots[--state->free_count] : replay->slots++;
+    size_t i = map_find(&state->map, address, 1);
+    state->map.keys[i] = address;
+    state->map.values[i] = slot;
+    return slot;
+}
+
+static void emit(struct replay *replay, struct slot_state *state, int op, uint32_t slot, uint64_t size)
+{
+    state->live += size - (op == TRACE_MALLOC || op == TRACE_CALLOC ? 0 : state->sizes[slot]);
+    state->sizes[slot] = op == TRACE_FREE ? 0 : size;
+    if (state->live > replay->peak_live) {
+        replay->peak_live = state->live;
+    }
+    replay->ops[replay->count].op = op;
+    replay->ops[replay->count].slot = slot;
+    replay->ops[replay->count].size = size;
+    replay->count++;
+}
+
+static void emit_free(struct replay *replay, struct slot_state *state, size_t i)
+{
+    uint32_t slot = state->map.values[i];
+    state->map.keys[i] = DELETED_KEY;
+    state->free_slots[state->free_count++] = slot;
+    emit(replay, state, TRACE_FREE, slot, 0);
+}
+
+/* Records from threads can come out of order around a free, so an address
+ * handed out while still live is taken to mean the old block was freed;
+ * frees of blocks from before tracing started are dropped. */
+static int load_trace(const char *path, struct replay *replay)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < TRACE_MAGIC_SIZE) {
+        return 0;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        return 0;
+    }
+    const unsigned char *end = data + st.st_size;
+
+    size_t records = 0;
+    int op;
+    uint64_t ptr, size, result;
+    const unsigned char *pos = data + TRACE_MAGIC_SIZE;
+    while (next_record(&pos, end, &op, &ptr, &size, &result)) {
+        records++;
+    }
+
+    size_t table = 2;
+    while (table < 2 * records) {
+        table *= 2;
+    }
+    struct slot_state state = {{map_array(table * sizeof(uint64_t)), map_array(table * sizeof(uint32_t)), table - 1},
+                               map_array(records * sizeof(uint32_t)), 0,
+                               map_array(records * sizeof(uint64_t)), 0};
+    /* A stale free can add one extra op per record */
+    replay->capacity = 2 * records;
+    replay->ops = map_array(replay->capacity * sizeof(struct replay_op));
+    replay->count = replay->slots = replay->peak_live = 0;
+
+    pos = data + TRACE_MAGIC_SIZE;
+    while (next_record(&pos, end, &op, &ptr, &size, &result)) {
+        size_t i;
+        switch (op) {
+            case TRACE_MALLOC:
+            case TRACE_CALLOC:
+                if (result == 0) {
+                    break;
+                }
+                if ((i = map_find(&state.map, result, 0)) != (size_t) -1) {
+                    emit_free(replay, &state, i);
+                }
+                emit(replay, &state, op, take_slot(replay, &state, result), size);
+                break;
+            case TRACE_REALLOC:
+                i = map_find(&state.map, ptr, 0);
+                if (result == 0) {
+                    /* realloc(p, 0) frees; a failed realloc leaves p alone */
+                    if (size == 0 && i != (size_t) -1) {
+                        emit_free(replay, &state, i);
+                    }
+                } else if (i == (size_t) -1) {
+                    emit(replay, &state, TRACE_MALLOC, take_slot(replay, &state, result), size);
+                } else {
+                    uint32_t slot = state.map.values[i];
+                    state.map.keys[i] = DELETED_KEY;
+                    size_t j = map_find(&state.map, result, 0);
+                    if (j != (size_t) -1) {
+                        emit_free(replay, &state, j);
+                    }
+                    j = map_find(&state.map, result, 1);
+                    state.map.keys[j] = result;
+                    state.map.values[j] = slot;
+                    emit(replay, &state, TRACE_REALLOC, slot, size);
+                }
+                break;
+            case TRACE_FREE:
+                if ((i = map_find(&state.map, ptr, 0)) != (size_t) -1) {
+                    emit_free(replay, &state, i);
+                }
+                break;
+        }
+    }
+
+    munmap(data, st.st_size);
+    munmap(state.map.keys, table * sizeof(uint64_t));
+    munmap(state.map.values, table * sizeof(uint32_t));
+    munmap(state.free_slots, records * sizeof(uint32_t));
+    munmap(state.sizes, records * sizeof(uint64_t));
+    return 1;
+}
+
+/* Write one byte per page so blocks are as resident as a real program
+ * would make them */
+static void touch(char *ptr, size_t size)
+{
+    if (ptr != NULL) {
+        for (size_t offset = 0; offset < size; offset += REPLAY_PAGE) {
+            ptr[offset] = 1;
+        }
+    }
+}
+
+static void run(const struct replay *replay, const struct allocator *alloc)
+{
+    char **ptrs = map_array(replay->slots * sizeof(char *));
+    size_t baseline = current_rss();
+
+    double start = now();
+    for (size_t i = 0; i < replay->count; i++) {
+        const struct replay_op *op = &replay->ops[i];
+        switch (op->op) {
+            case TRACE_MALLOC:
+                ptrs[op->slot] = alloc->malloc(op->size);
+                touch(ptrs[op->slot], op->size);
+                break;
+            case TRACE_CALLOC:
+                ptrs[op->slot] = alloc->calloc(1, op->size);
+                touch(ptrs[op->slot], op->size);
+                break;
+            case TRACE_REALLOC:
+                ptrs[op->slot] = alloc->realloc(ptrs[op->slot], op->size);
+                touch(ptrs[op->slot], op->size);
+                break;
+            case TRACE_FREE:
+                alloc->free(ptrs[op->slot]);
+                ptrs[op->slot] = NULL;
+                break;
+        }
+    }
+    double elapsed = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double growth = usage.ru_maxrss * 1024.0 - baseline;
+    double fragmentation = growth > replay->peak_live ? 1 - replay->peak_live / growth : 0;
+    printf("  %-8s %8.2f Mops/s, peak RSS %8.1f MB, fragmentation %.3f\n", alloc->name,
+           replay->count / elapsed / 1e6, growth / (1 << 20), fragmentation);
+    if (alloc->report != NULL) {
+        alloc->report();
+    }
+}
+
+static void replay_file(const char *path)
+{
+    struct replay replay;
+    if (!load_trace(path, &replay)) {
+        fprintf(stderr, "%s: not a readable trace\n", path);
+        return;
+    }
+    printf("%s: %zu ops, %zu slots, peak live %.1f MB\n", path, replay.count, replay.slots,
+           replay.peak_live / (double) (1 << 20));
+    fflush(stdout);
+
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(&replay, &allocators[a]);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    munmap(replay.ops, replay.capacity * sizeof(struct replay_op));
+}
+
+
+/* Synthetic traces. Addresses are just unique numbers; the replay only
+ * needs them to pair frees with allocations. */
+static uint64_t next_address;
+
+static void *fresh_address(void)
+{
+    next_address += ALIGNMENT;
+    return (void *) next_address;
+}
+
+static void *trace_malloc(size_t size)
+{
+    void *ptr = fresh_address();
+    mm_trace_record(TRACE_MALLOC, NULL, size, ptr);
+    return ptr;
+}
+
+static void *trace_realloc(void *old, size_t size)
+{
+    void *ptr = fresh_address();
+    mm_trace_record(TRACE_REALLOC, old, size, ptr);
+    return ptr;
+}
+
+static void trace_free(void *ptr)
+{
+    mm_trace_record(TRACE_FREE, ptr, 0, NULL);
+}
+
+/* Sizes spread evenly over powers of two from 16 bytes to 16 << spread */
+static size_t log_size(unsigned int *seed, int spread)
+{
+    size_t base = (size_t) 16 << rand_r(seed) % spread;
+    return base + rand_r(seed) % base;
+}
+
+#define WEB_CONNECTIONS 64
+#define WEB_REQUESTS 40000
+#define WEB_MAX_BUFFERS 48
+
+/* Requests on interleaved connections, each allocating a few dozen mostly
+ * small buffers that all go when the request ends */
+static void generate_web(void)
+{
+    void *buffers[WEB_CONNECTIONS][WEB_MAX_BUFFERS];
+    int counts[WEB_CONNECTIONS] = {0};
+    unsigned int seed = 162;
+
+    for (int request = 0; request < WEB_REQUESTS;) {
+        int c = rand_r(&seed) % WEB_CONNECTIONS;
+        if (counts[c] > 0) {
+            for (int i = counts[c] - 1; i >= 0; i -= 2) {
+                trace_free(buffers[c][i]);
+            }
+            for (int i = counts[c] % 2; i < counts[c]; i += 2) {
+                trace_free(buffers[c][i]);
+            }
+            counts[c] = 0;
+            continue;
+        }
+        counts[c] = 8 + rand_r(&seed) % (WEB_MAX_BUFFERS - 8);
+        for (int i = 0; i < counts[c]; i++) {
+            int kind = rand_r(&seed) % 100;
+            size_t size = kind < 70 ? log_size(&seed, 4) : kind < 95 ? log_size(&seed, 8) : 16384 + rand_r(&seed) % 49152;
+            buffers[c][i] = trace_malloc(size);
+        }
+        request++;
+    }
+}
+
+#define VECTORS 32
+#define VECTOR_ROUNDS 400
+#define VECTOR_LIMIT (256 * 1024)
+
+/* Dynamic arrays growing by half again at a time with short-lived
+ * temporaries in between, then dropped and started over */
+static void generate_vector(void)
+{
+    void *vectors[VECTORS];
+    size_t sizes[VECTORS];
+    unsigned int seed = 162;
+
+    for (int v = 0; v < VECTORS; v++) {
+        sizes[v] = 16;
+        vectors[v] = trace_malloc(sizes[v]);
+    }
+    for (int round = 0; round < VECTOR_ROUNDS * VECTORS; round++) {
+        int v = rand_r(&seed) % VECTORS;
+        if (sizes[v] >= VECTOR_LIMIT) {
+            trace_free(vectors[v]);
+            sizes[v] = 16;
+            vectors[v] = trace_malloc(sizes[v]);
+            continue;
+        }
+        sizes[v] += sizes[v] / 2;
+        vectors[v] = trace_realloc(vectors[v], sizes[v]);
+        trace_free(trace_malloc(sizes[v] / 4));
+    }
+    for (int v = 0; v < VECTORS; v++) {
+        trace_free(vectors[v]);
+    }
+}
+
+#define LONG_LIVED 20000
+#define BURSTS 3000
+#define BURST_SIZE 200
+
+/* A long-lived population that slowly turns over, with bursts of
+ * short-lived objects freed in reverse in between */
+static void generate_mixed(void)
+{
+    static void *long_lived[LONG_LIVED];
+    void *burst[BURST_SIZE];
+    unsigned int seed = 162;
+
+    for (int i = 0; i < LONG_LIVED; i++) {
+        long_lived[i] = trace_malloc(log_size(&seed, 7));
+    }
+    for (int b = 0; b < BURSTS; b++) {
+        int n = 1 + rand_r(&seed) % BURST_SIZE;
+        for (int i = 0; i < n; i++) {
+            burst[i] = trace_malloc(log_size(&seed, 5));
+        }
+        for (int i = 0; i < 20; i++) {
+            int victim = rand_r(&seed) % LONG_LIVED;
+            trace_free(long_lived[victim]);
+            long_lived[victim] = trace_malloc(log_size(&seed, 7));
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            trace_free(burst[i]);
+        }
+    }
+    for (int i = 0; i < LONG_LIVED; i++) {
+        trace_free(long_lived[i]);
+    }
+}
+
+struct generator {
+    const char *name;
+    void (*run)(void);
+};
+
+static const struct generator generators[] = {
+    {"web", generate_web},
+    {"vector", generate_vector},
+    {"mixed", generate_mixed},
+};
+
+static int generate(const char *dir)
+{
+    char path[4096];
+    mkdir(dir, 0755);
+    for (size_t g = 0; g < sizeof(generators) / sizeof(generators[0]); g++) {
+        snprintf(path, sizeof(path), "%s/%s.trace", dir, generators[g].name);
+        if (mm_trace_open(path) < 0) {
+            perror(path);
+            return 1;
+        }
+        generators[g].run();
+        mm_trace_close();
+        printf("wrote %s\n", path);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--generate") == 0) {
+        return generate(argv[2]);
+    }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s trace...\n       %s --generate directory\n", argv[0], argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        replay_file(argv[i]);
+    }
+    return 0;
+}
@@ -1,7 +1,578 @@
 /* A simple test harness for memory alloction. */
 
+#define _GNU_SOURCE
 #include "mm_alloc.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STRESS_SLOTS 512
+#define STRESS_ROUNDS 20000
+#define STRESS_THREADS 4
+#define HANDOFF_BLOCKS 1000
+#define POOL_OBJECTS 5000
+#define BATCH_OBJECTS 1000
+#define TRIM_BLOCKS 100
+#define TRIM_BLOCK_SIZE 10000
+#define PROFILE_BLOCKS 1000
+#define PROFILE_BLOCK_SIZE 4000
+#define PROFILE_INTERVAL (64 * 1024)
+#define SHM_SIZE (1 << 20)
+#define SHM_BLOCKS 500
+
+/* Random malloc/realloc/free mix; every live block carries a fill pattern
+ * that must survive whatever the allocator does to its neighbours. */
+static int stress_test(unsigned int seed)
+{
+    unsigned char *slots[STRESS_SLOTS] = {0};
+    size_t sizes[STRESS_SLOTS] = {0};
+
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        int i = rand_r(&seed) % STRESS_SLOTS;
+        if (slots[i] != NULL) {
+            for (size_t j = 0; j < sizes[i]; j++) {
+                if (slots[i][j] != (unsigned char) i) {
+                    return 0;
+                }
+            }
+        }
+        size_t size = 1 + rand_r(&seed) % (rand_r(&seed) % 8 == 0 ? 8192 : 256);
+        switch (rand_r(&seed) % 3) {
+            case 0:
+                mm_free(slots[i]);
+                slots[i] = NULL;
+                sizes[i] = 0;
+                break;
+            case 1:
+                slots[i] = mm_realloc(slots[i], size);
+                if (slots[i] == NULL) {
+                    return 0;
+                }
+                memset(slots[i], i, size);
+                sizes[i] = size;
+                break;
+            default:
+                mm_free(slots[i]);
+                slots[i] = mm_malloc(size);
+                if (slots[i] == NULL) {
+                    return 0;
+                }
+                memset(slots[i], i, size);
+                sizes[i] = size;
+                break;
+        }
+    }
+
+    for (int i = 0; i < STRESS_SLOTS; i++) {
+        mm_free(slots[i]);
+    }
+    return 1;
+}
+
+static void *stress_thread(void *arg)
+{
+    return (void *) (long) stress_test((unsigned int) (long) arg);
+}
+
+/* Each thread frees what the previous one allocated, so every free is a
+ * remote free into another thread's cache */
+static void *handoff_thread(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        mm_free(blocks[i]);
+        blocks[i] = mm_malloc(1 + i % CACHE_LIMIT);
+        memset(blocks[i], 0xab, 1 + i % CACHE_LIMIT);
+    }
+    return NULL;
+}
+
+static int thread_test(void)
+{
+    pthread_t threads[STRESS_THREADS];
+    void *result;
+    int ok = 1;
+
+    for (long i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_thread, (void *) (i + 1));
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        ok &= result != NULL;
+    }
+
+    void *blocks[HANDOFF_BLOCKS];
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        blocks[i] = mm_malloc(1 + i % CACHE_LIMIT);
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, handoff_thread, blocks);
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        mm_free(blocks[i]);
+    }
+    return ok;
+}
+
+/* Objects span several slabs; once all are freed only the spare slab is
+ * left mapped. Pointers the pool never handed out, even ones whose slab
+ * would be unmapped, are ignored. */
+static int pool_test(void)
+{
+    static unsigned char *objects[POOL_OBJECTS];
+    mm_pool_ptr pool = mm_pool_create(40);
+    if (pool == NULL || mm_pool_create(0) != NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+        objects[i] = mm_pool_alloc(pool);
+        if (objects[i] == NULL || (size_t) objects[i] % ALIGNMENT != 0) {
+            return 0;
+        }
+        memset(objects[i], i, 40);
+    }
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+        for (int j = 0; j < 40; j++) {
+            if (objects[i][j] != (unsigned char) i) {
+                return 0;
+            }
+        }
+    }
+    if (pool->slabs < 2) {
+        return 0;
+    }
+
+    mm_pool_free(pool, objects[0] + 8);
+    void *heap = mm_malloc(40);
+    char stack[SLAB_SIZE];
+    char *unmapped = mmap(NULL, 2 * SLAB_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unmapped == MAP_FAILED) {
+        return 0;
+    }
+    munmap(unmapped, 2 * SLAB_SIZE);
+    unmapped = (char *) (((size_t) unmapped + SLAB_SIZE - 1) & ~(size_t) (SLAB_SIZE - 1));
+    mm_pool_free(pool, heap);
+    mm_pool_free(pool, stack + SLAB_SIZE / 2);
+    mm_pool_free(pool, unmapped + ((sizeof(struct pool_slab) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1)));
+    mm_free(heap);
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+        mm_pool_free(pool, objects[i]);
+    }
+    if (pool->slabs != 1) {
+        return 0;
+    }
+
+    void *again = mm_pool_alloc(pool);
+    mm_pool_free(pool, again);
+    if (mm_pool_alloc(pool) != again) {
+        return 0;
+    }
+    mm_pool_destroy(pool);
+    return 1;
+}
+
+/* An arena on a small stack buffer has to chain chunks; after a reset it
+ * starts over in the buffer. Sizes too big to hold fail. */
+static int arena_test(void)
+{
+    char buffer[256];
+    mm_arena_ptr arena = mm_arena_create(buffer, sizeof(buffer));
+    if (arena == NULL || mm_arena_create(buffer, 8) != NULL) {
+        return 0;
+    }
+
+    for (int round = 0; round < 3; round++) {
+        unsigned char *first = NULL;
+        unsigned char *objects[100];
+        for (int i = 0; i < 100; i++) {
+            size_t size = 1 + i * 37 % 500;
+            objects[i] = mm_arena_alloc(arena, size);
+            if (objects[i] == NULL || (size_t) objects[i] % ALIGNMENT != 0) {
+                return 0;
+            }
+            memset(objects[i], i, size);
+            first = first == NULL ? objects[i] : first;
+        }
+        for (int i = 0; i < 100; i++) {
+            if (objects[i][0] != i || objects[i][i * 37 % 500] != i) {
+                return 0;
+            }
+        }
+        if (first < (unsigned char *) buffer || first >= (unsigned char *) buffer + sizeof(buffer)) {
+            return 0;
+        }
+        mm_arena_reset(arena);
+    }
+    mm_arena_destroy(arena);
+
+    arena = mm_arena_create(NULL, 0);
+    if (arena == NULL || mm_arena_alloc(arena, 1 << 20) == NULL) {
+        return 0;
+    }
+    /* Sizes that would wrap when aligned, or that no chunk could hold */
+    if (mm_arena_alloc(arena, SIZE_MAX) != NULL || mm_arena_alloc(arena, SIZE_MAX - ALIGNMENT + 2) != NULL ||
+        mm_arena_alloc(arena, PTRDIFF_MAX) != NULL) {
+        return 0;
+    }
+    mm_arena_destroy(arena);
+    return 1;
+}
+
+/* A child maps the same memory at another address, fills blocks there and
+ * leaves their offsets under root; the parent checks and frees them all,
+ * after which the heap must be one block again */
+static int shm_test(void)
+{
+    int fd = memfd_create("shm_test", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, SHM_SIZE) != 0) {
+        return 0;
+    }
+    void *region = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    mm_shm_ptr shm = region == MAP_FAILED ? NULL : mm_shm_create(region, SHM_SIZE);
+    if (shm == NULL || mm_shm_attach(region) != shm) {
+        return 0;
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        void *view = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        mm_shm_ptr other = mm_shm_attach(view);
+        if (view == MAP_FAILED || other == NULL || (void *) other == (void *) shm) {
+            _exit(1);
+        }
+        size_t *offsets = mm_shm_alloc(other, SHM_BLOCKS * sizeof(size_t));
+        for (int i = 0; i < SHM_BLOCKS; i++) {
+            size_t size = 1 + i * 37 % 1000;
+            unsigned char *block = mm_shm_alloc(other, size);
+            if (block == NULL) {
+                _exit(1);
+            }
+            memset(block, i, size);
+            offsets[i] = mm_shm_offset(other, block);
+        }
+        other->root = mm_shm_offset(other, offsets);
+        _exit(0);
+    }
+    int status;
+    if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return 0;
+    }
+
+    size_t *offsets = mm_shm_pointer(shm, shm->root);
+    for (int i = 0; i < SHM_BLOCKS; i++) {
+        size_t size = 1 + i * 37 % 1000;
+        unsigned char *block = mm_shm_pointer(shm, offsets[i]);
+        if (block[0] != (unsigned char) i || block[size - 1] != (unsigned char) i) {
+            return 0;
+        }
+        /* Every other one first, so the rest have free neighbours to join */
+        if (i % 2 == 0) {
+            mm_shm_free(shm, block);
+        }
+    }
+    for (int i = 1; i < SHM_BLOCKS; i += 2) {
+        mm_shm_free(shm, mm_shm_pointer(shm, offsets[i]));
+    }
+    mm_shm_free(shm, offsets);
+    /* Blocks that are not live are ignored */
+    mm_shm_free(shm, offsets);
+    mm_shm_free(shm, (char *) offsets + 16);
+    if (shm->in_use != 0) {
+        return 0;
+    }
+
+    void *all = mm_shm_alloc(shm, SHM_SIZE - sizeof(struct mm_shm) - 64);
+    if (all == NULL || mm_shm_alloc(shm, SHM_SIZE) != NULL) {
+        return 0;
+    }
+    mm_shm_free(shm, all);
+    mm_shm_destroy(shm);
+    munmap(region, SHM_SIZE);
+    close(fd);
+    return 1;
+}
+
+/* Counters have to follow a known mix of heap and mapped allocations */
+static int stats_test(void)
+{
+    struct mm_stats before, after;
+    void *blocks[5];
+
+    mm_stats(&before);
+    for (int i = 0; i < 5; i++) {
+        blocks[i] = mm_malloc(2000);
+    }
+    void *big = mm_malloc(1 << 20);
+    mm_stats(&after);
+
+    int ok = after.allocations == before.allocations + 6 &&
+             after.mapped_allocations == before.mapped_allocations + 1 &&
+             after.mmap_calls == before.mmap_calls + 1 &&
+             after.mapped_bytes >= before.mapped_bytes + (1 << 20) &&
+             after.in_use_bytes >= before.in_use_bytes + 5 * 2000 &&
+             after.heap_bytes == after.in_use_bytes + after.free_bytes &&
+             after.largest_free <= after.free_bytes;
+    for (int i = 0; i < 5; i++) {
+        mm_free(blocks[i]);
+    }
+    mm_free(big);
+    mm_stats(&after);
+    return ok && after.munmap_calls == before.munmap_calls + 1 && after.coalesces > before.coalesces;
+}
+
+/* Aligned blocks of every kind must be usable, freeable and, in the heap,
+ * cost little more than their size */
+static int memalign_test(void)
+{
+    static const size_t alignments[] = {32, 64, 256, 4096, 65536, 1 << 21};
+    static const size_t sizes[] = {1, 100, 5000, 300000};
+
+    for (int a = 0; a < 6; a++) {
+        for (int s = 0; s < 4; s++) {
+            struct mm_stats before, after;
+            mm_stats(&before);
+            char *ptr = mm_memalign(alignments[a], sizes[s]);
+            mm_stats(&after);
+            if (ptr == NULL || (size_t) ptr % alignments[a] != 0 || mm_usable_size(ptr) < sizes[s]) {
+                return 0;
+            }
+            if (after.in_use_bytes > before.in_use_bytes + sizes[s] + 2 * MIN_BLOCK_SIZE) {
+                return 0;
+            }
+            memset(ptr, 0x5a, sizes[s]);
+            mm_free(ptr);
+        }
+    }
+
+    char *ptr = mm_aligned_alloc(4096, 8192);
+    ptr = mm_realloc(ptr, 16384);
+    if (ptr == NULL || mm_memalign(48, 16) != NULL || mm_memalign((size_t) 1 << 62, 16) != NULL ||
+        mm_memalign((size_t) 1 << 63, 16) != NULL) {
+        return 0;
+    }
+    mm_free(ptr);
+    return 1;
+}
+
+/* Freed blocks wait unmerged in the quick bins; a repeat free must not
+ * park a block twice, and blocks that overflowed a bin must come back out
+ * live */
+static int quick_test(void)
+{
+    static const size_t sizes[] = {48, 600};
+    void *blocks[4 * QUICK_BIN_MAX];
+
+    for (int s = 0; s < 2; s++) {
+        void *ptr = mm_malloc(sizes[s]);
+        mm_free(ptr);
+        mm_free(ptr);
+        if (mm_malloc(sizes[s]) != ptr || mm_malloc(sizes[s]) == ptr) {
+            return 0;
+        }
+
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < 4 * QUICK_BIN_MAX; i++) {
+                blocks[i] = mm_malloc(sizes[s]);
+                if (blocks[i] == NULL || mm_usable_size(blocks[i]) < sizes[s]) {
+                    return 0;
+                }
+                memset(blocks[i], i, sizes[s]);
+            }
+            for (int i = 0; i < 4 * QUICK_BIN_MAX; i++) {
+                mm_free(blocks[i]);
+            }
+        }
+    }
+    return 1;
+}
+
+/* Taken by the profiler around its sample table */
+extern pthread_mutex_t profile_lock;
+
+/* Whether mm_stats_dump's report contains text */
+static int dump_contains(const char *text)
+{
+    FILE *out = tmpfile();
+    if (out == NULL) {
+        return 0;
+    }
+    mm_stats_dump(fileno(out));
+    rewind(out);
+    char line[1024];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), out) != NULL) {
+        found = strstr(line, text) != NULL;
+    }
+    fclose(out);
+    return found;
+}
+
+/* With profiling on, the folded profile's estimate of the live bytes must
+ * come out near what is really live, and freeing the blocks must drop
+ * their samples. A dump, as from a signal handler, must not wait for the
+ * profile lock. */
+static int profile_test(void)
+{
+    static char *blocks[PROFILE_BLOCKS];
+    struct mm_stats stats;
+
+    if (mm_config(MM_PROFILE_INTERVAL, PROFILE_INTERVAL) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < PROFILE_BLOCKS; i++) {
+        blocks[i] = mm_malloc(PROFILE_BLOCK_SIZE);
+    }
+    mm_stats(&stats);
+    if (stats.profile_samples == 0) {
+        return 0;
+    }
+
+    FILE *folded = tmpfile();
+    if (folded == NULL || mm_profile_dump(fileno(folded), MM_PROFILE_FOLDED) != 0) {
+        return 0;
+    }
+    rewind(folded);
+    char line[8192];
+    double estimate = 0;
+    unsigned long lines = 0;
+    while (fgets(line, sizeof(line), folded) != NULL) {
+        char *bytes = strrchr(line, ' ');
+        if (bytes == NULL || strchr(line, ';') == NULL) {
+            return 0;
+        }
+        estimate += atof(bytes + 1);
+        lines++;
+    }
+    fclose(folded);
+    double live = (double) PROFILE_BLOCKS * PROFILE_BLOCK_SIZE;
+    if (lines != stats.profile_samples || estimate < live / 2 || estimate > live * 2) {
+        return 0;
+    }
+
+    FILE *pprof = tmpfile();
+    if (pprof == NULL || mm_profile_dump(fileno(pprof), MM_PROFILE_PPROF) != 0) {
+        return 0;
+    }
+    rewind(pprof);
+    char header[64];
+    snprintf(header, sizeof(header), "@ heap_v2/%d\n", PROFILE_INTERVAL);
+    if (fgets(line, sizeof(line), pprof) == NULL || strncmp(line, "heap profile: ", 14) != 0 ||
+        strstr(line, header) == NULL) {
+        return 0;
+    }
+    fclose(pprof);
+
+    pthread_mutex_lock(&profile_lock);
+    int busy = dump_contains("mm_stats: profile busy");
+    pthread_mutex_unlock(&profile_lock);
+    if (!busy || !dump_contains(" live samples, ")) {
+        return 0;
+    }
+
+    mm_config(MM_PROFILE_INTERVAL, 0);
+    for (int i = 0; i < PROFILE_BLOCKS; i++) {
+        mm_free(blocks[i]);
+    }
+    mm_stats(&stats);
+    return stats.profile_samples == 0;
+}
+
+/* Free space in the middle of the heap goes back to the kernel, on its own
+ * once a free block reaches the trim threshold and otherwise on mm_trim,
+ * and only once */
+static int trim_test(void)
+{
+    char *blocks[TRIM_BLOCKS];
+    struct mm_stats before, after;
+    unsigned char resident = 1;
+
+    for (int round = 0; round < 2; round++) {
+        /* The second round purges by hand only */
+        mm_config(MM_TRIM_THRESHOLD, round == 0 ? DEFAULT_TRIM_THRESHOLD : (size_t) -1);
+        for (int i = 0; i < TRIM_BLOCKS; i++) {
+            blocks[i] = mm_malloc(TRIM_BLOCK_SIZE);
+            memset(blocks[i], 0xff, TRIM_BLOCK_SIZE);
+        }
+        char *guard = mm_malloc(TRIM_BLOCK_SIZE);
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        char *page = (char *) (((size_t) blocks[TRIM_BLOCKS / 2] + ALIGNMENT + page_size - 1) &
+                               ~(page_size - 1));
+
+        mm_stats(&before);
+        for (int i = 0; i < TRIM_BLOCKS; i++) {
+            mm_free(blocks[i]);
+        }
+        if (round == 1) {
+            mm_trim();
+            if (mm_trim() != 0) {
+                return 0;
+            }
+        }
+        mm_stats(&after);
+        if (after.purged_bytes < before.purged_bytes + TRIM_BLOCKS * TRIM_BLOCK_SIZE / 2 ||
+            mincore(page, 1, &resident) != 0 || (resident & 1) != 0) {
+            return 0;
+        }
+
+        char *again = mm_calloc(10, TRIM_BLOCK_SIZE);
+        for (int i = 0; i < 10 * TRIM_BLOCK_SIZE; i++) {
+            if (again == NULL || again[i] != 0) {
+                return 0;
+            }
+        }
+        mm_free(again);
+        mm_free(guard);
+    }
+    mm_config(MM_TRIM_THRESHOLD, DEFAULT_TRIM_THRESHOLD);
+    return 1;
+}
+
+/* A batch comes out of one region and, freed in any order, goes back as
+ * one free block */
+static int batch_test(void)
+{
+    static void *ptrs[BATCH_OBJECTS + 3];
+    struct mm_stats stats;
+
+    if (mm_malloc_batch(100, BATCH_OBJECTS, ptrs) != BATCH_OBJECTS) {
+        return 0;
+    }
+    for (int i = 0; i < BATCH_OBJECTS; i++) {
+        if ((size_t) ptrs[i] % ALIGNMENT != 0 || mm_usable_size(ptrs[i]) < 100 ||
+            (i > 0 && (char *) ptrs[i] != (char *) ptrs[i - 1] + 128)) {
+            return 0;
+        }
+        memset(ptrs[i], i, 100);
+    }
+    for (int i = 0; i < BATCH_OBJECTS; i++) {
+        if (((unsigned char *) ptrs[i])[99] != (unsigned char) i) {
+            return 0;
+        }
+    }
+
+    /* Shuffled, with a repeat, a NULL and a pointer into a block */
+    unsigned int seed = 162;
+    for (int i = BATCH_OBJECTS - 1; i > 0; i--) {
+        int j = rand_r(&seed) % (i + 1);
+        void *swap = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = swap;
+    }
+    ptrs[BATCH_OBJECTS] = ptrs[0];
+    ptrs[BATCH_OBJECTS + 1] = NULL;
+    ptrs[BATCH_OBJECTS + 2] = (char *) ptrs[1] + 16;
+    mm_free_batch(ptrs, BATCH_OBJECTS + 3);
+    mm_stats(&stats);
+    return stats.largest_free >= (size_t) BATCH_OBJECTS * 128 && mm_malloc_batch(100, 0, ptrs) == 0;
+}
+
 int main(int argc, char **argv)
 {
     int *data;
@@ -17,5 +588,144 @@ int main(int argc, char **argv)
     mm_free(data3);
     mm_free(data2);
     printf("malloc sanity test successful!\n");
+
+    /* A freed block should be handed out again instead of growing the heap */
+    data = (int*) mm_malloc(24);
+    mm_free(data);
+    if (mm_malloc(24) != data) {
+        printf("free list reuse test failed!\n");
+        return 1;
+    }
+    printf("free list reuse test successful!\n");
+
+    /* Pointers that did not come from mm_malloc must be ignored */
+    data = (int*) mm_malloc(64);
+    data[0] = 162;
+    mm_free(data + 2);
+    mm_free(&data2);
+    if (mm_realloc(data + 2, 128) != NULL || data[0] != 162) {
+        printf("invalid free test failed!\n");
+        return 1;
+    }
+    mm_free(data);
+    printf("invalid free test successful!\n");
+
+    /* Growing into a freed neighbour and shrinking keep the block in place */
+    char *grow = mm_malloc(1000);
+    char *neighbour = mm_malloc(1000);
+    char *guard = mm_malloc(1000);
+    memset(grow, 7, 1000);
+    mm_free(neighbour);
+    if (mm_realloc(grow, 1900) != grow || mm_realloc(grow, 600) != grow || grow[599] != 7) {
+        printf("in-place realloc test failed!\n");
+        return 1;
+    }
+    mm_free(grow);
+    mm_free(guard);
+    printf("in-place realloc test successful!\n");
+
+    /* mm_calloc must hand back zeros even when it reuses a dirty block */
+    size_t calloc_sizes[] = {64, 300, 200000};
+    for (int i = 0; i < 3; i++) {
+        char *dirty = mm_malloc(calloc_sizes[i]);
+        memset(dirty, 0xff, calloc_sizes[i]);
+        mm_free(dirty);
+        char *clean = mm_calloc(calloc_sizes[i] / 4, 4);
+        for (size_t j = 0; j < calloc_sizes[i]; j++) {
+            if (clean[j] != 0) {
+                printf("calloc test failed!\n");
+                return 1;
+            }
+        }
+        mm_free(clean);
+    }
+    if (mm_calloc((size_t) -1, 16) != NULL) {
+        printf("calloc test failed!\n");
+        return 1;
+    }
+    printf("calloc test successful!\n");
+
+    /* Large blocks come from their own mapping and leave the break alone */
+    void *brk_before = sbrk(0);
+    char *big = mm_malloc(64 << 20);
+    big[0] = 1;
+    big[(64 << 20) - 1] = 2;
+    big = mm_realloc(big, 128 << 20);
+    if (big == NULL || big[0] != 1 || big[(64 << 20) - 1] != 2) {
+        printf("large block test failed!\n");
+        return 1;
+    }
+    mm_free(big);
+    if (sbrk(0) != brk_before) {
+        printf("large block test failed!\n");
+        return 1;
+    }
+    printf("large block test successful!\n");
+
+    if (!stats_test()) {
+        printf("stats test failed!\n");
+        return 1;
+    }
+    printf("stats test successful!\n");
+
+    if (!memalign_test()) {
+        printf("memalign test failed!\n");
+        return 1;
+    }
+    printf("memalign test successful!\n");
+
+    if (!trim_test()) {
+        printf("trim test failed!\n");
+        return 1;
+    }
+    printf("trim test successful!\n");
+
+    if (!profile_test()) {
+        printf("profile test failed!\n");
+        return 1;
+    }
+    printf("profile test successful!\n");
+
+    if (!quick_test()) {
+        printf("quick bin test failed!\n");
+        return 1;
+    }
+    printf("quick bin test successful!\n");
+
+    if (!batch_test()) {
+        printf("batch test failed!\n");
+        return 1;
+    }
+    printf("batch test successful!\n");
+
+    if (!pool_test()) {
+        printf("pool test failed!\n");
+        return 1;
+    }
+    printf("pool test successful!\n");
+
+    if (!arena_test()) {
+        printf("arena test failed!\n");
+        return 1;
+    }
+    printf("arena test successful!\n");
+
+    if (!shm_test()) {
+        printf("shm test failed!\n");
+        return 1;
+    }
+    printf("shm test successful!\n");
+
+    if (!stress_test(162)) {
+        printf("malloc stress test failed!\n");
+        return 1;
+    }
+    printf("malloc stress test successful!\n");
+
+    if (!thread_test()) {
+        printf("malloc thread test failed!\n");
+        return 1;
+    }
+    printf("malloc thread test successful!\n");
     return 0;
 }
@@ -0,0 +1,131 @@
+#include "mm_trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* One trace per process. Records from all threads go through one buffer
+ * under trace_lock, so the file keeps the order calls returned in. */
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+int trace_fd = -1;
+unsigned char trace_buffer[TRACE_BUFFER_SIZE];
+size_t trace_used = 0;
+pthread_once_t trace_fork_once = PTHREAD_ONCE_INIT;
+
+/* Whether this thread holds trace_lock from mm_trace_begin, in which case
+ * anything the call it is tracing allocates is recorded without it */
+__thread int trace_held = 0;
+
+static void write_all(const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(trace_fd, buf, len);
+        if (written <= 0) {
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+static void put_varint(uint64_t value) {
+    while (value >= 0x80) {
+        trace_buffer[trace_used++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    trace_buffer[trace_used++] = (unsigned char) value;
+}
+
+static void lock_trace(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void unlock_trace(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* A forked child would write the parent's buffered records a second time
+ * and interleave its own with the parent's, so it stops tracing */
+static void stop_trace_in_child(void) {
+    trace_fd = -1;
+    trace_used = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void register_fork_handlers(void) {
+    pthread_atfork(lock_trace, unlock_trace, stop_trace_in_child);
+}
+
+int mm_trace_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    pthread_once(&trace_fork_once, register_fork_handlers);
+    pthread_mutex_lock(&trace_lock);
+    trace_fd = fd;
+    trace_used = 0;
+    write_all((const unsigned char *) TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+static void append_record(int op, void *ptr, size_t size, void *result) {
+    if (trace_fd < 0) {
+        return;
+    }
+    if (trace_used + TRACE_RECORD_MAX > TRACE_BUFFER_SIZE) {
+        write_all(trace_buffer, trace_used);
+        trace_used = 0;
+    }
+
+    trace_buffer[trace_used++] = (unsigned char) op;
+    if (op == TRACE_REALLOC || op == TRACE_FREE) {
+        put_varint((uintptr_t) ptr);
+    }
+    if (op != TRACE_FREE) {
+        put_varint(size);
+        put_varint((uintptr_t) result);
+    }
+}
+
+void mm_trace_record(int op, void *ptr, size_t size, void *result) {
+    if (trace_held) {
+        append_record(op, ptr, size, result);
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    append_record(op, ptr, size, result);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void mm_trace_begin(void) {
+    pthread_mutex_lock(&trace_lock);
+    trace_held = 1;
+}
+
+void mm_trace_end(int op, void *ptr, size_t size, void *result) {
+    append_record(op, ptr, size, result);
+    trace_held = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void mm_trace_flush(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        write_all(trace_buffer, trace_used);
+        trace_used = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void mm_trace_close(void) {
+    mm_trace_flush();
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
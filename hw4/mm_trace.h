@@ -0,0 +1,59 @@
+#pragma once
+
+#ifndef _mm_trace_H_
+#define _mm_trace_H_
+
+/* Allocation traces. A trace file starts with TRACE_MAGIC, followed by one
+ * record per call in the order the calls returned: an op byte and then its
+ * fields as LEB128 varints.
+ *
+ *     TRACE_MALLOC   size result
+ *     TRACE_CALLOC   size result       (size is count * size)
+ *     TRACE_REALLOC  ptr size result
+ *     TRACE_FREE     ptr
+ *
+ * Pointers are the addresses the traced program saw; a replayer only uses
+ * them to match frees and reallocs to the allocation they belong to. */
+#define TRACE_MAGIC "mmtrace1"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_MALLOC 'm'
+#define TRACE_CALLOC 'c'
+#define TRACE_REALLOC 'r'
+#define TRACE_FREE 'f'
+
+/* Records are gathered in a buffer of this size between writes */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/* Longest encoded record: op byte and three 64-bit varints */
+#define TRACE_RECORD_MAX (1 + 3 * 10)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+int mm_trace_open(const char *path);
+
+void mm_trace_record(int op, void *ptr, size_t size, void *result);
+
+/* For a call that both frees and allocates, like realloc. Once it frees
+ * ptr another thread can be handed that address, and just before it
+ * allocates another thread can free the address it returns; either way
+ * that thread's record could land on the wrong side of the call's.
+ * mm_trace_begin holds back every other thread's records until
+ * mm_trace_end records the call. */
+void mm_trace_begin(void);
+
+void mm_trace_end(int op, void *ptr, size_t size, void *result);
+
+void mm_trace_flush(void);
+
+void mm_trace_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif